@@ -0,0 +1,134 @@
+/* ----------------------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   http://lammps.sandia.gov, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+#include <string.h>
+#include "atom.h"
+#include "compute_nnp_atom.h"
+#include "error.h"
+#include "force.h"
+#include "memory.h"
+#include "pair_nnp.h"
+#include "update.h"
+
+using namespace LAMMPS_NS;
+
+/* ---------------------------------------------------------------------- */
+
+ComputeNNPAtom::ComputeNNPAtom(LAMMPS *lmp, int narg, char **arg)
+    : Compute(lmp, narg, arg) {
+  int iarg = 3;
+
+  dEdG = 0;
+  while (iarg < narg) {
+    if (strcmp(arg[iarg], "dEdG") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR, "Illegal compute nnp/atom command");
+      if (strcmp(arg[iarg + 1], "yes") == 0)
+        dEdG = 1;
+      else if (strcmp(arg[iarg + 1], "no") == 0)
+        dEdG = 0;
+      else
+        error->all(FLERR, "Illegal compute nnp/atom command");
+      iarg += 2;
+    } else
+      error->all(FLERR, "Illegal compute nnp/atom command");
+  }
+
+  // # of columns is fixed here, so the potential has to be read already
+
+  pair = find_pair();
+  if (pair == NULL)
+    error->all(FLERR, "Compute nnp/atom requires pair_style nnp");
+  nfeature = pair->nfeature;
+  if (nfeature == 0)
+    error->all(FLERR, "Compute nnp/atom must follow pair_coeff of "
+                      "pair_style nnp");
+
+  peratom_flag = 1;
+  size_peratom_cols = 2 + (1 + dEdG) * nfeature;
+  peatomflag = 1;
+  timeflag = 1;
+
+  nmax = 0;
+  values = NULL;
+}
+
+/* ---------------------------------------------------------------------- */
+
+ComputeNNPAtom::~ComputeNNPAtom() {
+  // the pair stops storing, unless LAMMPS is being destroyed
+  PairNNP *p = force ? find_pair() : NULL;
+  if (p) p->nnpatom = 0;
+  memory->destroy(values);
+}
+
+/* ---------------------------------------------------------------------- */
+
+PairNNP *ComputeNNPAtom::find_pair() {
+  return (PairNNP *)force->pair_match("nnp", 0);
+}
+
+/* ----------------------------------------------------------------------
+   the pair stores its values on steps of per-atom energy, which this
+   compute requests by peatomflag
+------------------------------------------------------------------------- */
+
+void ComputeNNPAtom::init() {
+  pair = find_pair();
+  if (pair == NULL)
+    error->all(FLERR, "Compute nnp/atom requires pair_style nnp");
+  if (pair->nfeature != nfeature)
+    error->all(FLERR, "Compute nnp/atom does not match the symmetry "
+                      "functions of pair_style nnp");
+  // dE/dG of the NN input is that of raw G only when preprocesses are merged
+  if (dEdG && pair->npreprocess > 0)
+    error->all(FLERR, "Compute nnp/atom dEdG yes requires merge yes of "
+                      "pair_style nnp");
+
+  if (pair->nnpatom != 1 + dEdG) {
+    pair->nnpatom = 1 + dEdG;
+    pair->maxnnpatom = 0;
+  }
+}
+
+/* ---------------------------------------------------------------------- */
+
+void ComputeNNPAtom::compute_peratom() {
+  int i, k;
+  int nlocal = atom->nlocal;
+  int *mask = atom->mask;
+
+  invoked_peratom = update->ntimestep;
+  if (update->eflag_atom != invoked_peratom || !pair->nnpatom_now)
+    error->all(FLERR, "Per-atom energy was not tallied on needed timestep");
+
+  if (atom->nmax > nmax) {
+    memory->destroy(values);
+    nmax = atom->nmax;
+    memory->create(values, nmax, size_peratom_cols, "nnp/atom:values");
+    array_atom = values;
+  }
+
+  for (i = 0; i < nlocal; i++) {
+    if (mask[i] & groupbit)
+      for (k = 0; k < size_peratom_cols; k++)
+        values[i][k] = pair->nnpatom_values[i][k];
+    else
+      for (k = 0; k < size_peratom_cols; k++) values[i][k] = 0.0;
+  }
+}
+
+/* ---------------------------------------------------------------------- */
+
+double ComputeNNPAtom::memory_usage() {
+  return (double)nmax * size_peratom_cols * sizeof(double);
+}
@@ -0,0 +1,54 @@
+/* -*- c++ -*- ----------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   http://lammps.sandia.gov, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+#ifdef COMPUTE_CLASS
+
+ComputeStyle(nnp/atom, ComputeNNPAtom)
+
+#else
+
+#ifndef LMP_COMPUTE_NNP_ATOM_H
+#define LMP_COMPUTE_NNP_ATOM_H
+
+#include "compute.h"
+
+namespace LAMMPS_NS {
+
+// atomic energy, # of raw G outside the scaling range, raw G and
+// optionally dE/dG of each atom, as stored by pair_style nnp at the step
+class ComputeNNPAtom : public Compute {
+ public:
+  ComputeNNPAtom(class LAMMPS *, int, char **);
+
+  ~ComputeNNPAtom();
+
+  void init();
+
+  void compute_peratom();
+
+  double memory_usage();
+
+ private:
+  int dEdG;                    // 1 if dE/dG columns are output
+  int nfeature;                // # of symmetry functions
+  int nmax;                    // # of rows of values
+  double **values;
+  class PairNNP *pair;
+
+  class PairNNP *find_pair();
+};
+
+}  // namespace LAMMPS_NS
+
+#endif
+#endif
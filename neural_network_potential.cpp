@@ -1,79 +1,275 @@
 #include "neural_network_potential.h"
 
-Layer::Layer(int in, int out, vector<double> &w, vector<double> &b, string act) {
-  weight = Map<MatrixXd>(&w[0], out, in);
-  bias = Map<VectorXd>(&b[0], out);
+#include <cmath>
+
+template <typename T>
+Layer<T>::Layer(int in, int out, const double *w, const double *b,
+                string act)
+    : weight(NULL, 0, 0), bias(NULL, 0) {
+  set(Map<const MatrixXd>(w, out, in).cast<T>(),
+      Map<const VectorXd>(b, out).cast<T>());
   set_activation(act);
+  nblock = 1;
+}
+
+// a copy is of the same kind as the original, a layer of its own storage
+// has a copy of the values, and a view over shared memory (see share) is
+// a view over the same memory, valid while the memory is
+template <typename T>
+Layer<T>::Layer(const Layer &other) : weight(NULL, 0, 0), bias(NULL, 0) {
+  *this = other;
+}
+
+// copy of a layer in another precision, always in its own storage
+template <typename T>
+template <typename U>
+Layer<T>::Layer(const Layer<U> &other) : weight(NULL, 0, 0), bias(NULL, 0) {
+  set(other.weight.template cast<T>(), other.bias.template cast<T>());
+  activation = other.activation_type();
+  nblock = other.blocks();
+}
+
+template <typename T>
+Layer<T>::~Layer() {}
+
+template <typename T>
+Layer<T> &Layer<T>::operator=(const Layer &other) {
+  if (this != &other) {
+    if (other.shared()) {
+      vector<T>().swap(storage);
+      new (&weight) Map<MatrixT>(const_cast<T *>(other.weight.data()),
+                                 other.weight.rows(), other.weight.cols());
+      new (&bias) Map<VectorT>(const_cast<T *>(other.bias.data()),
+                               other.bias.size());
+    } else
+      set(other.weight, other.bias);
+    activation = other.activation;
+    nblock = other.nblock;
+  }
+  return *this;
+}
+
+// new weight and bias into own storage, their shapes may change
+template <typename T>
+void Layer<T>::set(const MatrixT &w, const VectorT &b) {
+  vector<T> tmp(w.size() + b.size());
+  Map<MatrixT>(&tmp[0], w.rows(), w.cols()) = w;
+  Map<VectorT>(&tmp[w.size()], b.size()) = b;
+  storage.swap(tmp);
+  new (&weight) Map<MatrixT>(&storage[0], w.rows(), w.cols());
+  new (&bias) Map<VectorT>(&storage[w.size()], b.size());
+}
+
+// move weight and bias to p, which has room for size() values
+// copy is 0 if another rank has already written them to p
+template <typename T>
+void Layer<T>::share(T *p, int copy) {
+  if (copy) {
+    Map<MatrixT>(p, weight.rows(), weight.cols()) = weight;
+    Map<VectorT>(p + weight.size(), bias.size()) = bias;
+  }
+  new (&weight) Map<MatrixT>(p, weight.rows(), weight.cols());
+  new (&bias) Map<VectorT>(p + weight.size(), bias.size());
+  vector<T>().swap(storage);
+}
+
+// rows of weight are split into n blocks of the same size
+template <typename T>
+void Layer<T>::set_blocks(int n) {
+  nblock = n;
 }
 
-Layer::~Layer() {}
+// FAST_* have no name, they are set by approximate()
+int activation_index(const string &name) {
+  const char *names[IDENTITY + 1] = {"tanh", "elu", "sigmoid", "identity"};
+  int act;
 
-void Layer::tanh(VectorXd &input, VectorXd &deriv) {
-  // return = tanh(x)
-  // deriv  = 1 - tanh(x)^2 = 1 - return^2
-  input = input.array().tanh();
-  deriv = 1.0 - input.array().square();
+  for (act = 0; act <= IDENTITY; act++)
+    if (name == names[act]) return act;
+  return -1;
 }
 
-void Layer::elu(VectorXd &input, VectorXd &deriv) {
-  // return = exp(x) - 1, when x < 0
-  //          x         , when x > 0
-  // deriv  = exp(x)    , when x < 0
-  //          1         , when x > 0
-  // DON'T CHANGE ORDER OF FOLLOWING CALCULATIONS !!!
-  deriv = (input.array() < 0).select(input.array().exp(), VectorXd::Ones(input.size()));
-  input = (input.array() < 0).select(input.array().exp() - 1.0, input);
+// the name is checked by the reader of the potential file
+template <typename T>
+void Layer<T>::set_activation(string act) {
+  activation = activation_index(act);
 }
 
-void Layer::sigmoid(VectorXd &input, VectorXd &deriv) {
-  // return = sigmoid(x)
-  // deriv  = sigmoid(x) * (1-sigmoid(x)) = return * (1-return)
-  input = 1.0 / (1.0 + (-input).array().exp());
-  deriv = input.array() * (1.0 - input.array());
+// tanh and sigmoid by rational approximations
+template <typename T>
+void Layer<T>::approximate() {
+  if (activation == TANH) activation = FAST_TANH;
+  if (activation == SIGMOID) activation = FAST_SIGMOID;
 }
 
-void Layer::identity(VectorXd &input, VectorXd &deriv) {
-  // return = x
-  // deriv  = 1
-  deriv = VectorXd::Ones(input.size());
+// [9/8] Pade approximant of tanh, x is clamped to |x| <= 7.5
+// and the result to |tanh| <= 1.
+// |error| < 7e-6 for tanh and < 1.4e-5 for its derivative 1 - tanh^2
+template <typename T>
+static inline T fast_tanh(T x) {
+  x = x < T(-7.5) ? T(-7.5) : (x > T(7.5) ? T(7.5) : x);
+  T x2 = x * x;
+  T p = T(34459425) +
+        x2 * (T(4729725) + x2 * (T(135135) + x2 * (T(990) + x2)));
+  T q = T(34459425) +
+        x2 * (T(16216200) + x2 * (T(945945) + x2 * (T(13860) + x2 * T(45))));
+  T y = x * p / q;
+  return y < T(-1) ? T(-1) : (y > T(1) ? T(1) : y);
 }
 
-void Layer::set_activation(string act) {
-  if (act == "tanh") {
-    activation = &Layer::tanh;
-  } else if (act == "elu") {
-    activation = &Layer::elu;
-  } else if (act == "sigmoid") {
-    activation = &Layer::sigmoid;
-  } else if (act == "identity") {
-    activation = &Layer::identity;
+// out = f(out + bias) and deriv = f'(out + bias) of the first n columns
+// in one pass, so no temporaries are made
+template <typename T>
+template <int ACT>
+void Layer<T>::activate(MatrixT &out, MatrixT &deriv, int n) {
+  int c, r;
+  int rows = out.rows();
+  const T *b = bias.data();
+
+  for (c = 0; c < n; c++) {
+    T *o = out.data() + (long)c * rows;
+    T *d = deriv.data() + (long)c * rows;
+#pragma omp simd
+    for (r = 0; r < rows; r++) {
+      T x = o[r] + b[r];
+      if (ACT == TANH) {
+        // return = tanh(x)
+        // deriv  = 1 - tanh(x)^2 = 1 - return^2
+        T y = std::tanh(x);
+        o[r] = y;
+        d[r] = T(1) - y * y;
+      } else if (ACT == ELU) {
+        // return = exp(x) - 1, when x < 0
+        //          x         , when x > 0
+        // deriv  = exp(x)    , when x < 0
+        //          1         , when x > 0
+        T e = std::exp(x < T(0) ? x : T(0));
+        o[r] = x < T(0) ? e - T(1) : x;
+        d[r] = x < T(0) ? e : T(1);
+      } else if (ACT == SIGMOID) {
+        // return = sigmoid(x)
+        // deriv  = sigmoid(x) * (1-sigmoid(x)) = return * (1-return)
+        T y = T(1) / (T(1) + std::exp(-x));
+        o[r] = y;
+        d[r] = y * (T(1) - y);
+      } else if (ACT == IDENTITY) {
+        // return = x
+        // deriv  = 1
+        o[r] = x;
+        d[r] = T(1);
+      } else if (ACT == FAST_TANH) {
+        T y = fast_tanh(x);
+        o[r] = y;
+        d[r] = T(1) - y * y;
+      } else if (ACT == FAST_SIGMOID) {
+        // sigmoid(x) = (1 + tanh(x/2)) / 2
+        T y = T(0.5) + T(0.5) * fast_tanh(T(0.5) * x);
+        o[r] = y;
+        d[r] = y * (T(1) - y);
+      }
+    }
+  }
+}
+
+// each column of input is the input vector of one atom, n columns
+// out and deriv keep their capacity, only the first n columns are valid
+template <typename T>
+void Layer<T>::feedforward(const Ref<const MatrixT> &input, MatrixT &out,
+                           MatrixT &deriv, int n) {
+  if (out.rows() != weight.rows() || out.cols() < n) {
+    out.resize(weight.rows(), n);
+    deriv.resize(weight.rows(), n);
+  }
+  if (nblock == 1) {
+    out.leftCols(n).noalias() = weight * input;
   } else {
-    cout << "ERROR!! not implemented ACTIVATION FUNCTION!!" << endl;
+    int rows = weight.rows() / nblock;
+    int cols = weight.cols();
+    for (int k = 0; k < nblock; k++)
+      out.block(k * rows, 0, rows, n).noalias() =
+          weight.middleRows(k * rows, rows) * input.middleRows(k * cols, cols);
+  }
+
+  switch (activation) {
+    case TANH: activate<TANH>(out, deriv, n); break;
+    case ELU: activate<ELU>(out, deriv, n); break;
+    case SIGMOID: activate<SIGMOID>(out, deriv, n); break;
+    case IDENTITY: activate<IDENTITY>(out, deriv, n); break;
+    case FAST_TANH: activate<FAST_TANH>(out, deriv, n); break;
+    case FAST_SIGMOID: activate<FAST_SIGMOID>(out, deriv, n); break;
+    default: activate<IDENTITY>(out, deriv, n); break;
   }
 }
 
-void Layer::feedforward(VectorXd &input, VectorXd &deriv) {
-  input = (weight * input).colwise() + bias;
-  (this->*activation)(input, deriv);
+// grad = weight^T * delta, of each block for a block layer
+template <typename T>
+void Layer<T>::backward(const Ref<const MatrixT> &delta, Ref<MatrixT> grad) {
+  if (nblock == 1) {
+    grad.noalias() = weight.transpose() * delta;
+  } else {
+    int rows = weight.rows() / nblock;
+    int cols = weight.cols();
+    for (int k = 0; k < nblock; k++)
+      grad.middleRows(k * cols, cols).noalias() =
+          weight.middleRows(k * rows, rows).transpose() *
+          delta.middleRows(k * rows, rows);
+  }
 }
 
-NNP::NNP(int n) {
+template <typename T>
+NNP<T>::NNP(int n) {
   depth = n;
 }
 
-NNP::~NNP() {}
+// copy of a network in another precision
+template <typename T>
+template <typename U>
+NNP<T>::NNP(const NNP<U> &other) {
+  depth = other.depth;
+  for (int i = 0; i < (int)other.layers.size(); i++)
+    layers.push_back(Layer<T>(other.layers[i]));
+}
+
+template <typename T>
+NNP<T>::~NNP() {}
 
-void NNP::feedforward(VectorXd input, VectorXd &dE_dG, int eflag,
-                      double &evdwl) {
+// input : (# of features) x (# of atoms) matrix
+// dE_dG : (# of features) x (# of atoms) matrix
+// evdwl : atomic energy of each atom, the mean of outputs of a committee
+// out, deriv : output and derivative of each layer, reused as scratch of
+//              back propagation, out[i] has the same shape as the input of
+//              layer i+1
+template <typename T>
+void NNP<T>::feedforward(const Ref<const MatrixT> &input, Ref<MatrixT> dE_dG,
+                         int eflag, Ref<VectorT> evdwl, vector<MatrixT> &out,
+                         vector<MatrixT> &deriv) {
   int i;
-  VectorXd deriv[depth];
+  int n = input.cols();
+  int noutput = layers[depth - 1].weight.rows();
 
-  for (i = 0; i < depth; i++) layers[i].feedforward(input, deriv[i]);
-  dE_dG = VectorXd::Ones(1);
-  for (i = depth - 1; i >= 0; i--) {
-    dE_dG = dE_dG.array() * deriv[i].array();
-    dE_dG = dE_dG.transpose() * layers[i].weight;
-  }
+  out.resize(depth);
+  deriv.resize(depth);
 
-  if (eflag) evdwl = input.coeffRef(0);
+  layers[0].feedforward(input, out[0], deriv[0], n);
+  for (i = 1; i < depth; i++)
+    layers[i].feedforward(out[i - 1].leftCols(n), out[i], deriv[i], n);
+
+  if (eflag)
+    evdwl = out[depth - 1].leftCols(n).colwise().mean().transpose();
+
+  // dE/dy of the last layer is 1 (1/noutput for the mean of a committee),
+  // then delta_i = deriv_i * W_i+1^T delta_i+1
+  // out[depth - 1] is kept for the outputs of committee members
+  if (noutput > 1) deriv[depth - 1].leftCols(n) *= T(1) / T(noutput);
+  for (i = depth - 1; i > 0; i--) {
+    layers[i].backward(deriv[i].leftCols(n), out[i - 1].leftCols(n));
+    deriv[i - 1].leftCols(n).array() *= out[i - 1].leftCols(n).array();
+  }
+  layers[0].backward(deriv[0].leftCols(n), dE_dG);
 }
+
+template class Layer<double>;
+template class Layer<float>;
+template class NNP<double>;
+template class NNP<float>;
+template NNP<float>::NNP(const NNP<double> &);
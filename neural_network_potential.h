@@ -16,43 +16,94 @@
 using namespace std;
 using namespace Eigen;
 
+// activation functions, resolved from their names at load time
+// FAST_* are rational approximations, |error| < 7e-6 for tanh and 1.4e-5
+// for its derivative, half of them for sigmoid (see .cpp)
+enum { TANH, ELU, SIGMOID, IDENTITY, FAST_TANH, FAST_SIGMOID };
+
+// activation of a name in the potential file, -1 if unknown
+int activation_index(const string &);
+
+// T is the scalar type of weights and activations, double or float
+// weight and bias are views over storage of the layer itself,
+// or over memory shared by all ranks of a node (see share),
+// and a copy in the same precision is of the same kind
+// a layer of nblock blocks is nblock independent layers of the same shape,
+// their weights are stacked in rows, and block k maps the k-th part of
+// the input to the k-th part of the output (see PairNNP::stack_committee)
+template <typename T>
 class Layer {
+ public:
+  typedef Matrix<T, Dynamic, Dynamic> MatrixT;
+  typedef Matrix<T, Dynamic, 1> VectorT;
+
  private:
+  int activation;
+  int nblock;                  // # of diagonal blocks, 1 if dense
+  vector<T> storage;           // weight and bias, empty if shared
+
   void set_activation(string);
 
-  typedef void (Layer::*FuncPtr)(VectorXd &, VectorXd &);
+  template <int ACT>
+  void activate(MatrixT &, MatrixT &, int);
+
+ public:
+  Map<MatrixT> weight;
+  Map<VectorT> bias;
 
-  FuncPtr activation;
+  Layer(int, int, const double *, const double *, string);
 
-  void tanh(VectorXd &, VectorXd &);
+  Layer(const Layer &);
 
-  void elu(VectorXd &, VectorXd &);
+  template <typename U>
+  Layer(const Layer<U> &);
 
-  void sigmoid(VectorXd &, VectorXd &);
+  ~Layer();
 
-  void identity(VectorXd &, VectorXd &);
+  Layer &operator=(const Layer &);
 
- public:
-  MatrixXd weight;
-  VectorXd bias;
+  int activation_type() const { return activation; }
 
-  Layer(int, int, vector<double> &, vector<double> &, string);
+  int blocks() const { return nblock; }
 
-  ~Layer();
+  int shared() const { return storage.empty() && size() > 0; }
 
-  void feedforward(VectorXd &, VectorXd &);
+  void set_blocks(int);
+
+  void approximate();
+
+  int size() const { return weight.size() + bias.size(); }
+
+  void set(const MatrixT &, const VectorT &);
+
+  void share(T *, int);
+
+  void feedforward(const Ref<const MatrixT> &, MatrixT &, MatrixT &, int);
+
+  void backward(const Ref<const MatrixT> &, Ref<MatrixT>);
 };
 
+// out and deriv are scratch of each layer, given by the caller so that
+// they are reused over calls and threads don't share them
+// a network of several outputs is a committee, its energy is their mean
+template <typename T>
 class NNP {
  public:
+  typedef Matrix<T, Dynamic, Dynamic> MatrixT;
+  typedef Matrix<T, Dynamic, 1> VectorT;
+
   int depth;
-  vector<Layer> layers;
+  vector<Layer<T> > layers;
 
   NNP(int);
 
+  template <typename U>
+  NNP(const NNP<U> &);
+
   ~NNP();
 
-  void feedforward(VectorXd, VectorXd &, int, double &);
+  void feedforward(const Ref<const MatrixT> &, Ref<MatrixT>, int,
+                   Ref<VectorT>, vector<MatrixT> &, vector<MatrixT> &);
 };
 
 #endif
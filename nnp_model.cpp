@@ -0,0 +1,422 @@
+//
+// parameters of a neural network potential, shared by pair_style nnp and
+// the tools
+//
+
+#include "nnp_model.h"
+
+#include <fstream>
+
+#include "potential_file.h"
+
+NNPModel::NNPModel() {
+  cutmax = cutG4 = 0.0;
+  nelements = ntwobody = nthreebody = 0;
+  nG1params = nG2params = nG4params = 0;
+  fctype = CUTOFF_TANH3;
+  nfeature = 0;
+  npreprocess = 0;
+  scl_raw = 0;
+  scl_target_max = scl_target_min = 0.0;
+}
+
+/* ----------------------------------------------------------------------
+   unique elements, in the order of pair_coeff, and their combinations
+------------------------------------------------------------------------- */
+
+void NNPModel::set_elements(const vector<string> &names) {
+  int i, j, idx;
+
+  elements = names;
+  nelements = elements.size();
+  combinations = vector<vector<int> >(nelements, vector<int>(nelements));
+  idx = 0;
+  for (i = 0; i < nelements; i++)
+    for (j = i; j < nelements; j++)
+      combinations[i][j] = combinations[j][i] = idx++;
+  ntwobody = nelements;
+  nthreebody = idx;
+}
+
+/* ----------------------------------------------------------------------
+   potential parameters from the image, 0 on success
+   element blocks are matched to elements of pair_coeff by name
+------------------------------------------------------------------------- */
+
+int NNPModel::read_image(const char *data, long size, string &err) {
+  string sym_func_type, preprocess, element, activation;
+  int i, j, k, n, nw, nvalue, nentry, nrequired;
+  int ntype, depth, nlayer, insize, outsize;
+  const double *v, *w;
+  vector<vector<double> > *params;
+  ImageReader in(data, size);
+
+  // symmetry function parameters
+  nG1params = 0;
+  nG2params = 0;
+  nG4params = 0;
+  fctype = CUTOFF_TANH3;
+  ntype = in.get_int();
+
+  for (i = 0; i < ntype; i++) {
+    sym_func_type = in.get_string();
+    if (sym_func_type == "cutoff") {
+      element = in.get_string();
+      if (in.failed) break;
+      fctype = cutoff_type(element);
+      if (fctype < 0) {
+        err = "Unknown cutoff function " + element +
+              " in neural network potential";
+        return 1;
+      }
+      continue;
+    }
+    n = in.get_int();
+    v = in.get_array(nvalue);
+    if (in.failed) break;
+    if (sym_func_type == "type1") {
+      nG1params = n;
+      params = &G1params;        // Rc
+      nrequired = 1;
+    } else if (sym_func_type == "type2") {
+      nG2params = n;
+      params = &G2params;        // Rc eta Rs
+      nrequired = 3;
+    } else if (sym_func_type == "type4") {
+      nG4params = n;
+      params = &G4params;        // Rc eta lambda zeta
+      nrequired = 4;
+    } else {
+      err = "Unknown symmetry function in neural network potential";
+      return 1;
+    }
+    if (n < 0 || (n > 0 && (nvalue % n != 0 || nvalue / n < nrequired)) ||
+        (n == 0 && nvalue != 0)) {
+      err = "Inconsistent binary neural network potential file";
+      return 1;
+    }
+    nvalue = n > 0 ? nvalue / n : 0;
+    *params = vector<vector<double> >(n);
+    for (j = 0; j < n; j++)
+      (*params)[j].assign(v + j * nvalue, v + (j + 1) * nvalue);
+  }
+  nfeature = ntwobody * (nG1params + nG2params) + nthreebody * nG4params;
+
+  // preprocess parameters
+  preprocesses.clear();
+  scl_raw = 0;
+  npreprocess = in.get_int();
+
+  for (i = 0; i < npreprocess; i++) {
+    preprocess = in.get_string();
+
+    if (preprocess == "pca") {
+      preprocesses.push_back(&NNPModel::pca);
+      pca_transform = vector<MatrixXd>(nelements);
+      pca_mean = vector<VectorXd>(nelements);
+      nentry = in.get_int();
+      for (j = 0; j < nentry; j++) {
+        element = in.get_string();
+        outsize = in.get_int();
+        insize = in.get_int();
+        v = in.get_array(n);
+        w = in.get_array(nw);
+        if (in.failed) break;
+        if (insize < 0 || outsize < 0 || n != (long)insize * outsize ||
+            nw != insize) {
+          err = "Inconsistent binary neural network potential file";
+          return 1;
+        }
+        for (k = 0; k < nelements; k++)
+          if (elements[k] == element) {
+            pca_transform[k] =
+                Map<const MatrixXd>(v, insize, outsize).transpose();
+            pca_mean[k] = Map<const VectorXd>(w, insize);
+          }
+      }
+    } else if (preprocess == "scaling") {
+      preprocesses.push_back(&NNPModel::scaling);
+      scl_raw = i == 0;
+      scl_max = vector<VectorXd>(nelements);
+      scl_min = vector<VectorXd>(nelements);
+      v = in.get_array(n);
+      if (in.failed) break;
+      if (n != 2) {
+        err = "Scaling target must be a max and a min in neural network "
+              "potential";
+        return 1;
+      }
+      scl_target_max = v[0];
+      scl_target_min = v[1];
+      nentry = in.get_int();
+      for (j = 0; j < nentry; j++) {
+        element = in.get_string();
+        nvalue = in.get_int();
+        v = in.get_array(n);
+        w = in.get_array(nw);
+        if (in.failed) break;
+        if (n != nvalue || nw != nvalue) {
+          err = "Inconsistent binary neural network potential file";
+          return 1;
+        }
+        for (k = 0; k < nelements; k++)
+          if (elements[k] == element) {
+            scl_max[k] = Map<const VectorXd>(v, n);
+            scl_min[k] = Map<const VectorXd>(w, n);
+          }
+      }
+    } else if (preprocess == "standardization") {
+      preprocesses.push_back(&NNPModel::standardization);
+      std_mean = vector<VectorXd>(nelements);
+      std_std = vector<VectorXd>(nelements);
+      nentry = in.get_int();
+      for (j = 0; j < nentry; j++) {
+        element = in.get_string();
+        nvalue = in.get_int();
+        v = in.get_array(n);
+        w = in.get_array(nw);
+        if (in.failed) break;
+        if (n != nvalue || nw != nvalue) {
+          err = "Inconsistent binary neural network potential file";
+          return 1;
+        }
+        for (k = 0; k < nelements; k++)
+          if (elements[k] == element) {
+            std_mean[k] = Map<const VectorXd>(v, n);
+            std_std[k] = Map<const VectorXd>(w, n);
+          }
+      }
+    } else {
+      err = "Unknown preprocess in neural network potential";
+      return 1;
+    }
+  }
+
+  // neural network parameters
+  depth = in.get_int();
+  nlayer = in.get_int();
+  if (depth < 0 || nlayer < 0) {
+    err = "Inconsistent binary neural network potential file";
+    return 1;
+  }
+  masters.clear();
+  for (i = 0; i < nelements; i++) masters.push_back(NNP<double>(depth));
+
+  for (i = 0; i < nlayer; i++) {
+    element = in.get_string();
+    in.get_int();
+    insize = in.get_int();
+    outsize = in.get_int();
+    activation = in.get_string();
+    v = in.get_array(n);
+    w = in.get_array(nw);
+    if (in.failed) break;
+    if (insize < 0 || outsize < 0 || n != (long)insize * outsize ||
+        nw != outsize) {
+      err = "Inconsistent binary neural network potential file";
+      return 1;
+    }
+    if (activation_index(activation) < 0) {
+      err = "Unknown activation function " + activation +
+            " in neural network potential";
+      return 1;
+    }
+
+    for (j = 0; j < nelements; j++)
+      if (elements[j] == element)
+        masters[j].layers.push_back(
+            Layer<double>(insize, outsize, v, w, activation));
+  }
+
+  if (in.failed) {
+    err = "Incomplete binary neural network potential file";
+    return 1;
+  }
+
+  // depth layers of each element, each fed by the output of the previous
+  for (k = 0; k < nelements; k++) {
+    if (masters[k].layers.empty()) continue;
+    int chained = (int)masters[k].layers.size() == depth;
+    for (i = 1; chained && i < depth; i++)
+      chained = masters[k].layers[i].weight.cols() ==
+                masters[k].layers[i - 1].weight.rows();
+    if (!chained) {
+      err = "Inconsistent binary neural network potential file";
+      return 1;
+    }
+  }
+
+  // G of each element through the preprocesses into the 1st layer
+  for (k = 0; k < nelements; k++) {
+    if (masters[k].layers.empty()) {
+      err = "No neural network of element " + elements[k] +
+            " in neural network potential";
+      return 1;
+    }
+    n = nfeature;
+    for (i = 0; i < npreprocess && n >= 0; i++) {
+      if (preprocesses[i] == &NNPModel::pca)
+        n = pca_transform[k].cols() == n ? pca_transform[k].rows() : -1;
+      else if (preprocesses[i] == &NNPModel::scaling)
+        n = scl_max[k].size() == n ? n : -1;
+      else
+        n = std_mean[k].size() == n ? n : -1;
+    }
+    if (n != masters[k].layers[0].weight.cols()) {
+      err = "Sizes of preprocesses and neural network of element " +
+            elements[k] + " do not match the symmetry functions";
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* ----------------------------------------------------------------------
+   whole potential file, text or binary, on one process, 0 on success
+   pair_style nnp reads it on rank 0 and broadcasts the image instead
+------------------------------------------------------------------------- */
+
+int NNPModel::load(const char *file, string &err) {
+  int status;
+  const char *data;
+  long size;
+  vector<char> image;
+
+  if (is_binary_file(file)) {
+    if (map_file(file, data, size, err)) return 1;
+    status = check_image(data, size, err) || read_image(data, size, err);
+    unmap_file(data, size);
+    return status;
+  }
+
+  ifstream fin(file);
+  if (!fin) {
+    err = string("Cannot open neural network potential file ") + file;
+    return 1;
+  }
+  if (text_to_image(fin, nelements, image, err)) return 1;
+  return read_image(&image[0], image.size(), err);
+}
+
+/* ----------------------------------------------------------------------
+   model compilation
+   all preprocesses are affine, G' = A * G + c, so the whole chain is
+   merged into the 1st layer, W' = W * A and b' = W * c + b,
+   and no preprocess is applied to G and dG/dx at every step.
+   tools/nnp_check compares the energy and forces with the unmerged chain
+------------------------------------------------------------------------- */
+
+void NNPModel::merge_preprocess() {
+  int i, p;
+  MatrixXd A, dG[2];
+  VectorXd c;
+
+  for (i = 0; i < nelements; i++) {
+    Layer<double> &first = masters[i].layers[0];
+
+    // accumulate the chain on the raw identity map, G = I * G + 0
+
+    A = MatrixXd::Identity(nfeature, nfeature);
+    c = VectorXd::Zero(nfeature);
+    dG[0] = dG[1] = MatrixXd::Zero(nfeature, 0);
+    for (p = 0; p < npreprocess; p++)
+      (this->*preprocesses[p])(i, c, A, dG[0], dG[1]);
+
+    first.set(first.weight * A, first.weight * c + first.bias);
+  }
+
+  preprocesses.clear();
+  npreprocess = 0;
+}
+
+/* ----------------------------------------------------------------------
+   flat tables of G1, G2 and G4 and the cutoffs
+   ntable > 0 tabulates radial functions
+   G4 of integer zeta up to maxzeta are expanded in moments, 0 for none
+------------------------------------------------------------------------- */
+
+void NNPModel::setup(int ntable, int maxzeta) {
+  int i;
+
+  radial_params = RadialParams();
+  radial_params.fctype = fctype;
+  for (i = 0; i < nG1params; i++)
+    radial_params.add(G1params[i][0], 0.0, 0.0, ntwobody * i);
+  for (i = 0; i < nG2params; i++)
+    radial_params.add(G2params[i][0], G2params[i][1], G2params[i][2],
+                      ntwobody * (nG1params + i));
+
+  angular_params = AngularParams();
+  for (i = 0; i < nG4params; i++)
+    angular_params.add(G4params[i][0],
+                       radial_params.cutoff_index(G4params[i][0]),
+                       G4params[i][1], G4params[i][2], G4params[i][3],
+                       ntwobody * (nG1params + nG2params) + nthreebody * i);
+
+  angular_params.expand(maxzeta, combinations);
+
+  if (ntable > 0) {
+    radial_params.tabulate(ntable);
+    angular_params.tabulate(ntable, fctype);
+  }
+
+  cutmax = cutG4 = 0.0;
+  for (i = 0; i < nG1params; i++)
+    if (G1params[i][0] > cutmax) cutmax = G1params[i][0];
+  for (i = 0; i < nG2params; i++)
+    if (G2params[i][0] > cutmax) cutmax = G2params[i][0];
+  for (i = 0; i < nG4params; i++)
+    if (G4params[i][0] > cutG4) cutG4 = G4params[i][0];
+  if (cutG4 > cutmax) cutmax = cutG4;
+}
+
+/* ----------------------------------------------------------------------
+   pseudo-random values in [-1, 1) from seed, in the order of storage,
+   the same on all ranks and platforms for load-time checks
+------------------------------------------------------------------------- */
+
+void NNPModel::probe(MatrixXd &values, unsigned int seed) {
+  int k;
+  double *v = values.data();
+
+  for (k = 0; k < values.size(); k++) {
+    seed = 1103515245u * seed + 12345u;
+    v[k] = 2.0 * (seed >> 8) / 16777216.0 - 1.0;
+  }
+}
+
+/* ---------------------------------------------------------------------- */
+
+void NNPModel::pca(int type, VectorXd &G, MatrixXd &dG_dx, MatrixXd &dG_dy,
+                   MatrixXd &dG_dz) {
+  G = pca_transform[type] * (G - pca_mean[type]);
+  dG_dx = pca_transform[type] * dG_dx;
+  dG_dy = pca_transform[type] * dG_dy;
+  dG_dz = pca_transform[type] * dG_dz;
+}
+
+void NNPModel::scaling(int type, VectorXd &G, MatrixXd &dG_dx,
+                       MatrixXd &dG_dy, MatrixXd &dG_dz) {
+  G = ((G - scl_min[type]).array() *
+       (scl_max[type] - scl_min[type]).array().inverse() *
+       (scl_target_max - scl_target_min))
+          .array() +
+      scl_target_min;
+  dG_dx = dG_dx.array().colwise() *
+          (scl_max[type] - scl_min[type]).array().inverse() *
+          (scl_target_max - scl_target_min);
+  dG_dy = dG_dy.array().colwise() *
+          (scl_max[type] - scl_min[type]).array().inverse() *
+          (scl_target_max - scl_target_min);
+  dG_dz = dG_dz.array().colwise() *
+          (scl_max[type] - scl_min[type]).array().inverse() *
+          (scl_target_max - scl_target_min);
+}
+
+void NNPModel::standardization(int type, VectorXd &G, MatrixXd &dG_dx,
+                               MatrixXd &dG_dy, MatrixXd &dG_dz) {
+  G = (G - std_mean[type]).array() * std_std[type].array().inverse();
+  dG_dx = dG_dx.array().colwise() * std_std[type].array().inverse();
+  dG_dy = dG_dy.array().colwise() * std_std[type].array().inverse();
+  dG_dz = dG_dz.array().colwise() * std_std[type].array().inverse();
+}
@@ -0,0 +1,76 @@
+//
+// parameters of a neural network potential, shared by pair_style nnp and
+// the tools
+//
+
+#ifndef HDNNP_LAMMPS_NNP_MODEL_H
+#define HDNNP_LAMMPS_NNP_MODEL_H
+
+#include "neural_network_potential.h"
+#include "symmetry_function.h"
+
+// max deviation of NN in single precision from double precision, relative
+// to the largest energy and dE/dG, or energy per atom and force, accepted
+// by pair_style nnp precision mixed and tools/nnp_check
+#define NNP_MIXED_TOLERANCE 1.0e-4
+
+// symmetry functions, preprocesses and NN of each element of one potential
+// file, read from its image. errors are returned as a status and a message,
+// so that the callers report them in their own way
+class NNPModel {
+ public:
+  NNPModel();
+
+  virtual ~NNPModel() {}
+
+  double cutmax;               // max cutoff for all elements
+  double cutG4;                // max cutoff of G4
+  int nelements;               // # of unique elements
+  int ntwobody;                // # of 2-body combinations
+  int nthreebody;              // # of 3-body combinations
+  vector<vector<int> > combinations;  // index of combination of 2 element
+  vector<string> elements;     // names of unique elements
+  vector<NNP<double> > masters;  // parameter set for an I-J-K interaction
+  int nG1params, nG2params, nG4params;
+  vector<vector<double> > G1params, G2params, G4params;
+  int fctype;                  // type of cutoff function of all of them
+  RadialParams radial_params;  // G1 and G2 as flat arrays
+  AngularParams angular_params;  // G4 grouped by shared factors
+  int nfeature;
+  int npreprocess;
+  vector<MatrixXd> pca_transform;
+  vector<VectorXd> pca_mean;
+  vector<VectorXd> scl_max;
+  vector<VectorXd> scl_min;
+  int scl_raw;                 // 1 if scaling is the 1st preprocess, so
+                               // scl_min/scl_max are the range of raw G
+  double scl_target_max;
+  double scl_target_min;
+  vector<VectorXd> std_mean;
+  vector<VectorXd> std_std;
+
+  typedef void (NNPModel::*FuncPtr)(int, VectorXd &, MatrixXd &, MatrixXd &,
+                                    MatrixXd &);
+
+  vector<FuncPtr> preprocesses;
+
+  void set_elements(const vector<string> &);
+
+  int read_image(const char *, long, string &);
+
+  int load(const char *, string &);
+
+  void merge_preprocess();
+
+  void setup(int, int);
+
+  static void probe(MatrixXd &, unsigned int);
+
+  void pca(int, VectorXd &, MatrixXd &, MatrixXd &, MatrixXd &);
+
+  void scaling(int, VectorXd &, MatrixXd &, MatrixXd &, MatrixXd &);
+
+  void standardization(int, VectorXd &, MatrixXd &, MatrixXd &, MatrixXd &);
+};
+
+#endif  // HDNNP_LAMMPS_NNP_MODEL_H
@@ -15,6 +15,7 @@
    Contributing author: Aidan Thompson (SNL)
 ------------------------------------------------------------------------- */
 
+#include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,6 +34,8 @@
 #include "neigh_request.h"
 #include "neighbor.h"
 #include "pair_nnp.h"
+#include "potential_file.h"
+#include "update.h"
 
 using namespace LAMMPS_NS;
 
@@ -48,7 +51,36 @@ PairNNP::PairNNP(LAMMPS *lmp) : Pair(lmp) {
   manybody_flag = 1;
 
   nelements = 0;
-  nG1params = nG2params = nG4params = 0;
+  nbatch = 128;
+  merge = 1;
+  adjoint = 0;
+  mixed = 0;
+  shared = 0;
+  fast = 0;
+  timing = 0;
+  reuse = 0.0;
+  reuse_check = 0;
+  ntable = 0;
+  pairwise = 0;
+  icost = -1;
+  ispread = -1;
+  nmodel = 0;
+#ifdef NNP_SHARED_MEMORY
+  nodecomm = MPI_COMM_NULL;
+  modelwin = MPI_WIN_NULL;
+#endif
+
+  maxlocal = maxshort = 0;
+  numshort = NULL;
+  firstshort = NULL;
+  shortneigh = NULL;
+  cacheflag = cachehit = cachenum = cachej = NULL;
+  cacheE = cacher = cacheF = NULL;
+  fullslot = shortslot = NULL;
+  npair = maxpair = nterm = 0;
+  pairterm = NULL;
+  nnpatom = nnpatom_now = maxnnpatom = 0;
+  nnpatom_values = NULL;
 }
 
 /* ----------------------------------------------------------------------
@@ -63,91 +95,123 @@ PairNNP::~PairNNP() {
     memory->destroy(cutsq);
     memory->destroy(setflag);
   }
+
+  memory->destroy(numshort);
+  memory->sfree(firstshort);
+  memory->destroy(shortneigh);
+  memory->destroy(pvector);
+  memory->destroy(cacheflag);
+  memory->destroy(cachehit);
+  memory->destroy(cachenum);
+  memory->destroy(cacheE);
+  memory->destroy(cachej);
+  memory->destroy(cacher);
+  memory->destroy(cacheF);
+  memory->destroy(fullslot);
+  memory->destroy(shortslot);
+  memory->sfree(pairterm);
+  memory->destroy(nnpatom_values);
+
+  free_shared();
 }
 
 /* ---------------------------------------------------------------------- */
 
 void PairNNP::compute(int eflag, int vflag) {
-  int i, j, ii, jj, inum, jnum, p;
-  int itype, jtype, iparam;
-  double evdwl, fx, fy, fz, delx, dely, delz;
-  int *ilist, *jlist, *numneigh, **firstneigh;
-  vector<int> iG2s;
-  vector<vector<int> > iG3s;
-  VectorXd r[3], R, dR[3];
-  MatrixXd cos, dcos[3];
-  VectorXd G, dE_dG, F[3];
-  MatrixXd dG_dx, dG_dy, dG_dz;
-
-  evdwl = 0.0;
   if (eflag || vflag)
     ev_setup(eflag, vflag);
   else
     evflag = vflag_fdotr = 0;
 
-  double **x = atom->x;
-  double **f = atom->f;
-  int *type = atom->type;
+  // J neighbors within cutmax
 
-  inum = list->inum;
-  ilist = list->ilist;
-  numneigh = list->numneigh;
-  firstneigh = list->firstneigh;
+  if (neighbor->ago == 0) grow_short();
+  short_neighbor(0, list->inum);
+  if (pairwise) pair_terms(0, list->inum, workspaces[0]);
+  if (icost >= 0) cost_weights();
+  grow_nnpatom();
 
-  for (ii = 0; ii < inum; ii++) {
-    i = ilist[ii];          // local index of I atom
-    itype = map[type[i]];   // element
-    jlist = firstneigh[i];  // indices of J neighbors of I atom
-    jnum = numneigh[i];     // # of J neighbors of I atom
-
-    geometry(i, jlist, jnum, r, R, cos, dR, dcos);
-
-    G = VectorXd::Zero(nfeature);
-    dG_dx = MatrixXd::Zero(nfeature, jnum);
-    dG_dy = MatrixXd::Zero(nfeature, jnum);
-    dG_dz = MatrixXd::Zero(nfeature, jnum);
-
-    feature_index(jlist, jnum, iG2s, iG3s);
-    for (iparam = 0; iparam < nG1params; iparam++)
-      G1(G1params[iparam], ntwobody * iparam, iG2s, jnum, R, dR, G,
-         dG_dx, dG_dy, dG_dz);
-    for (iparam = 0; iparam < nG2params; iparam++)
-      G2(G2params[iparam], ntwobody * (nG1params + iparam), iG2s, jnum, R, dR,
-         G, dG_dx, dG_dy, dG_dz);
-    for (iparam = 0; iparam < nG4params; iparam++)
-      G4(G4params[iparam],
-         ntwobody * (nG1params + nG2params) + nthreebody * iparam, iG3s, jnum,
-         R, cos, dR, dcos, G, dG_dx, dG_dy, dG_dz);
-
-    for (p = 0; p < npreprocess; p++) {
-      (this->*preprocesses[p])(itype, G, dG_dx, dG_dy, dG_dz);
+  // global virial is from fdotr, pairwise tally is only for per-atom virial,
+  // or for global virial when fdotr is not used
+
+  if (evflag) {
+    if (eflag) {
+      if (vflag_atom || vflag_global) eval<1, 1, 1>();
+      else eval<1, 1, 0>();
+    } else {
+      if (vflag_atom || vflag_global) eval<1, 0, 1>();
+      else eval<1, 0, 0>();
     }
+  } else eval<0, 0, 0>();
+
+  if (icost >= 0) store_cost(0, list->inum);
+  if (vflag_fdotr) virial_fdotr_compute();
+  if (timing) sum_stats();
+}
+
+/* ----------------------------------------------------------------------
+   EFLAG : atomic energy is tallied once per I atom
+   VFLAG_PAIR : virial is tallied per I-J pair, half to each atom, for the
+                per-atom virial and the global one unless vflag_fdotr
+                sums it at the end
+------------------------------------------------------------------------- */
 
-    masters[itype].feedforward(G, dE_dG, eflag, evdwl);
-    evdwl *= 2.0 / jnum;
+template <int EVFLAG, int EFLAG, int VFLAG_PAIR>
+void PairNNP::eval() {
+  int i, j, ii, jj, ib, nb, inum, jnum;
+  int itype;
+  double fx, fy, fz;
+  int *jlist;
+  Workspace &ws = workspaces[0];
 
-    F[0].noalias() = -1.0 * dE_dG.transpose() * dG_dx;
-    F[1].noalias() = -1.0 * dE_dG.transpose() * dG_dy;
-    F[2].noalias() = -1.0 * dE_dG.transpose() * dG_dz;
+  double **f = atom->f;
+  int nlocal = atom->nlocal;
+
+  // sort I atoms by element so that each batch is fed into one NN at once
+
+  sort_by_element(list->ilist, list->inum, ws);
+
+  for (itype = 0; itype < nelements; itype++) {
+    inum = ws.ilists[itype].size();
+    for (ii = 0; ii < inum; ii += nbatch) {
+      nb = MIN(nbatch, inum - ii);
+      batch(itype, &ws.ilists[itype][ii], nb, EFLAG, ws);
+
+      for (ib = 0; ib < nb; ib++) {
+        i = ws.ilists[itype][ii + ib];
+        jlist = firstshort[i];
+        jnum = numshort[i];
+        lap(ws, -1);
+        force_neighbors(i, ib, ws);
+
+        for (jj = 0; jj < jnum; jj++) {
+          j = jlist[jj];
+          fx = ws.F[0].coeffRef(jj);
+          fy = ws.F[1].coeffRef(jj);
+          fz = ws.F[2].coeffRef(jj);
+          f[j][0] += fx;
+          f[j][1] += fy;
+          f[j][2] += fz;
+          f[i][0] -= fx;
+          f[i][1] -= fy;
+          f[i][2] -= fz;
+
+          // force on J times r_ij is that on I times r_ji, as ev_tally_xyz
+          // expects, and the virial of the pair is split between I and J
+          if (EVFLAG && VFLAG_PAIR)
+            ev_tally_xyz(i, j, nlocal, newton_pair, 0.0, 0.0, fx, fy, fz,
+                         ws.r[3 * ib + 0].coeffRef(jj),
+                         ws.r[3 * ib + 1].coeffRef(jj),
+                         ws.r[3 * ib + 2].coeffRef(jj));
+        }
 
-    for (jj = 0; jj < jnum; jj++) {
-      j = jlist[jj];
-      fx = F[0].coeffRef(jj);
-      fy = F[1].coeffRef(jj);
-      fz = F[2].coeffRef(jj);
-      delx = r[0].coeffRef(jj);
-      dely = r[1].coeffRef(jj);
-      delz = r[2].coeffRef(jj);
-      f[j][0] += fx;
-      f[j][1] += fy;
-      f[j][2] += fz;
-
-      if (evflag)
-        ev_tally_xyz_full(i, evdwl, 0.0, fx, fy, fz, delx, dely, delz);
+        if (EVFLAG && EFLAG)
+          ev_tally_full(i, 2.0 * ws.evdwls.coeffRef(ib), 0.0, 0.0, 0.0, 0.0,
+                        0.0);
+        lap(ws, TIME_FORCE);
+      }
     }
   }
-
-  if (vflag_fdotr) virial_fdotr_compute();
 }
 
 /* ---------------------------------------------------------------------- */
@@ -166,7 +230,118 @@ void PairNNP::allocate() {
 ------------------------------------------------------------------------- */
 
 void PairNNP::settings(int narg, char **arg) {
-  if (narg != 0) error->all(FLERR, "Illegal pair_style command");
+  int iarg = 0;
+
+  while (iarg < narg) {
+    if (strcmp(arg[iarg], "batch") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR, "Illegal pair_style command");
+      nbatch = force->inumeric(FLERR, arg[iarg + 1]);
+      if (nbatch <= 0) error->all(FLERR, "Illegal pair_style command");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "merge") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR, "Illegal pair_style command");
+      if (strcmp(arg[iarg + 1], "yes") == 0)
+        merge = 1;
+      else if (strcmp(arg[iarg + 1], "no") == 0)
+        merge = 0;
+      else
+        error->all(FLERR, "Illegal pair_style command");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "adjoint") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR, "Illegal pair_style command");
+      if (strcmp(arg[iarg + 1], "yes") == 0)
+        adjoint = 1;
+      else if (strcmp(arg[iarg + 1], "no") == 0)
+        adjoint = 0;
+      else
+        error->all(FLERR, "Illegal pair_style command");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "precision") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR, "Illegal pair_style command");
+      if (strcmp(arg[iarg + 1], "double") == 0)
+        mixed = 0;
+      else if (strcmp(arg[iarg + 1], "mixed") == 0)
+        mixed = 1;
+      else
+        error->all(FLERR, "Illegal pair_style command");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "shared") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR, "Illegal pair_style command");
+      if (strcmp(arg[iarg + 1], "yes") == 0)
+        shared = 1;
+      else if (strcmp(arg[iarg + 1], "no") == 0)
+        shared = 0;
+      else
+        error->all(FLERR, "Illegal pair_style command");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "activation") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR, "Illegal pair_style command");
+      if (strcmp(arg[iarg + 1], "exact") == 0)
+        fast = 0;
+      else if (strcmp(arg[iarg + 1], "fast") == 0)
+        fast = 1;
+      else
+        error->all(FLERR, "Illegal pair_style command");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "timing") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR, "Illegal pair_style command");
+      if (strcmp(arg[iarg + 1], "yes") == 0)
+        timing = 1;
+      else if (strcmp(arg[iarg + 1], "no") == 0)
+        timing = 0;
+      else
+        error->all(FLERR, "Illegal pair_style command");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "reuse") == 0) {
+      if (iarg + 3 > narg) error->all(FLERR, "Illegal pair_style command");
+      reuse = force->numeric(FLERR, arg[iarg + 1]);
+      reuse_check = force->inumeric(FLERR, arg[iarg + 2]);
+      if (reuse < 0.0 || reuse_check < 0)
+        error->all(FLERR, "Illegal pair_style command");
+      iarg += 3;
+    } else if (strcmp(arg[iarg], "table") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR, "Illegal pair_style command");
+      ntable = force->inumeric(FLERR, arg[iarg + 1]);
+      if (ntable < 0) error->all(FLERR, "Illegal pair_style command");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "pairwise") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR, "Illegal pair_style command");
+      if (strcmp(arg[iarg + 1], "yes") == 0)
+        pairwise = 1;
+      else if (strcmp(arg[iarg + 1], "no") == 0)
+        pairwise = 0;
+      else
+        error->all(FLERR, "Illegal pair_style command");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "cost") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR, "Illegal pair_style command");
+      if (strcmp(arg[iarg + 1], "none") == 0)
+        costname.clear();
+      else if (strncmp(arg[iarg + 1], "d_", 2) == 0 && arg[iarg + 1][2])
+        costname = &arg[iarg + 1][2];
+      else
+        error->all(FLERR, "Illegal pair_style command");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "spread") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR, "Illegal pair_style command");
+      if (strcmp(arg[iarg + 1], "none") == 0)
+        spreadname.clear();
+      else if (strncmp(arg[iarg + 1], "d_", 2) == 0 && arg[iarg + 1][2])
+        spreadname = &arg[iarg + 1][2];
+      else
+        error->all(FLERR, "Illegal pair_style command");
+      iarg += 2;
+    } else
+      error->all(FLERR, "Illegal pair_style command");
+  }
+
+  // stage times and counters are extra terms of compute pair
+  memory->destroy(pvector);
+  nextra = timing ? NTIME + NCOUNT + 1 : 0;
+  if (nextra) {
+    memory->create(pvector, nextra, "pair:pvector");
+    for (int k = 0; k < nextra; k++) pvector[k] = 0.0;
+  }
 }
 
 /* ----------------------------------------------------------------------
@@ -174,13 +349,17 @@ void PairNNP::settings(int narg, char **arg) {
 ------------------------------------------------------------------------- */
 
 void PairNNP::coeff(int narg, char **arg) {
-  int i, j, idx;
+  int i, j, m;
   int ntypes = atom->ntypes;
+  vector<string> names;
 
   if (!allocated) allocate();
 
-  if (narg != 3 + ntypes)
+  // one or more potential files, then one element per atom type
+
+  if (narg < 3 + ntypes)
     error->all(FLERR, "Incorrect args for pair coefficients");
+  nmodel = narg - 2 - ntypes;
 
   // insure I,J args are * *
 
@@ -189,46 +368,54 @@ void PairNNP::coeff(int narg, char **arg) {
 
   // read args that map atom types to elements in potential file
   // map[i] = which element the Ith atom type is, -1 if NULL
-  // nelements = # of unique elements
-  // elements = list of element names
+  // names = list of unique element names
 
-  if (!elements.empty()) elements.clear();
-
-  nelements = 0;
-  for (i = 3; i < narg; i++) {
+  for (i = 2 + nmodel; i < narg; i++) {
     if (strcmp(arg[i], "NULL") == 0) {
-      map[i - 2] = -1;
+      map[i - 1 - nmodel] = -1;
       continue;
     }
-    for (j = 0; j < nelements; j++)
-      if (string(arg[i]) == elements[j]) break;
-    map[i - 2] = j;
-    if (j == nelements) {
-      elements.push_back(string(arg[i]));
-      nelements++;
+    for (j = 0; j < (int)names.size(); j++)
+      if (string(arg[i]) == names[j]) break;
+    map[i - 1 - nmodel] = j;
+    if (j == (int)names.size()) names.push_back(string(arg[i]));
+  }
+  set_elements(names);
+
+  // read potential files and initialize potential parameters
+  // members of a committee must have the same symmetry functions
+
+  if (nmodel == 1) {
+    read_file(arg[2]);
+  } else {
+    vector<vector<NNP<double> > > members;
+    vector<vector<double> > G1ref, G2ref, G4ref;
+    int fcref = CUTOFF_TANH3;
+    for (m = 0; m < nmodel; m++) {
+      read_file(arg[2 + m]);
+      if (npreprocess > 0)
+        error->all(FLERR, "Pair style nnp with several potential files "
+                          "requires merge yes");
+      if (m == 0) {
+        G1ref = G1params;
+        G2ref = G2params;
+        G4ref = G4params;
+        fcref = fctype;
+      } else if (G1params != G1ref || G2params != G2ref ||
+                 G4params != G4ref || fctype != fcref) {
+        char str[128];
+        sprintf(str, "Symmetry functions of potential file %s differ from "
+                     "those of %s", arg[2 + m], arg[2]);
+        error->all(FLERR, str);
+      }
+      members.push_back(masters);
     }
+    stack_committee(members);
   }
-  combinations = vector<vector<int> >(ntypes, vector<int>(ntypes));
-  idx = 0;
-  for (i = 0; i < nelements; i++)
-    for (j = i; j < nelements; j++)
-      combinations[i][j] = combinations[j][i] = idx++;
-  ntwobody = nelements;
-  nthreebody = idx;
-
-  // read potential file and initialize potential parameters
-
-  read_file(arg[2]);
+  if (mixed) single_precision();
+  if (shared) share_model();
   setup_params();
 
-  cutmax = 0.0;
-  for (i = 0; i < nG1params; i++)
-    if (G1params[i][0] > cutmax) cutmax = G1params[i][0];
-  for (i = 0; i < nG2params; i++)
-    if (G2params[i][0] > cutmax) cutmax = G2params[i][0];
-  for (i = 0; i < nG4params; i++)
-    if (G4params[i][0] > cutmax) cutmax = G4params[i][0];
-
   for (i = 1; i < ntypes + 1; i++) {
     for (j = 1; j < ntypes + 1; j++) {
       cutsq[i][j] = cutmax * cutmax;
@@ -245,11 +432,196 @@ void PairNNP::init_style() {
   if (force->newton_pair == 0)
     error->all(FLERR,
                "Pair style Neural Network Potential requires newton pair on");
+  // adjoint mode contracts dE/dG with dG of raw symmetry functions
+  if (adjoint && npreprocess > 0)
+    error->all(FLERR, "Pair style nnp adjoint yes requires merge yes");
+
+  // per-atom cost and committee spread go to double properties of
+  // fix property/atom
+
+  icost = -1;
+  if (!costname.empty()) {
+    int flag;
+    icost = atom->find_custom(costname.c_str(), flag);
+    if (icost < 0 || flag != 1)
+      error->all(FLERR, "Pair style nnp cost requires a per-atom double "
+                        "property defined by fix property/atom");
+  }
+
+  ispread = -1;
+  if (!spreadname.empty()) {
+    int flag;
+    ispread = atom->find_custom(spreadname.c_str(), flag);
+    if (ispread < 0 || flag != 1)
+      error->all(FLERR, "Pair style nnp spread requires a per-atom double "
+                        "property defined by fix property/atom");
+  }
+
   // need a full neighbor list
 
   int irequest = neighbor->request(this, instance_me);
   neighbor->requests[irequest]->half = 0;
   neighbor->requests[irequest]->full = 1;
+
+  // one workspace per thread, they grow at first few steps
+  workspaces = vector<Workspace>(comm->nthreads);
+
+  if (pairwise) {
+    if ((int)radial_params.Rc.size() > NNP_MAX_CUTOFF)
+      error->all(FLERR, "Too many cutoff radii for pair_style nnp pairwise");
+    nterm = radial_terms_size(radial_params, angular_params);
+    for (int t = 0; t < (int)workspaces.size(); t++) {
+      workspaces[t].pairterms = 1;
+      workspaces[t].pterm_angular = 2 * radial_params.iparam.size();
+    }
+  }
+}
+
+/* ---------------------------------------------------------------------- */
+
+void PairNNP::finish() {
+  if (timing) report_timing();
+  if (reuse > 0.0) report_reuse();
+}
+
+/* ----------------------------------------------------------------------
+   stage times and counters of the run, summed over threads and ranks
+   (peak is the max). the time of a stage is its sum over threads of all
+   ranks, which can exceed the wall time with nnp/omp, so it is printed
+   as the average over threads and ranks. %total is the share of the sum
+   and "CPU ns/atom" is the sum per atom, the cost of an atom on a thread
+------------------------------------------------------------------------- */
+
+void PairNNP::report_timing() {
+  int k, nthreads;
+  double all[NTIME + NCOUNT + 1], total, natom;
+  char line[128];
+  string msg;
+  const char *names[NTIME] = {"geometry", "radial", "angular", "preprocess",
+                              "NN", "force"};
+
+  sum_stats();
+  MPI_Reduce(pvector, all, NTIME + NCOUNT, MPI_DOUBLE, MPI_SUM, 0, world);
+  MPI_Reduce(&pvector[NTIME + NCOUNT], &all[NTIME + NCOUNT], 1, MPI_DOUBLE,
+             MPI_MAX, 0, world);
+  if (comm->me != 0) return;
+
+  total = 0.0;
+  for (k = 0; k < NTIME; k++) total += all[k];
+  natom = MAX(all[NTIME + COUNT_ATOM], 1.0);
+
+  nthreads = workspaces.size();
+  sprintf(line, "\nPair nnp timing (average of %d procs x %d threads):\n",
+          comm->nprocs, nthreads);
+  msg += line;
+  msg += "Stage      |  time (s)  | %total | CPU ns/atom\n";
+  for (k = 0; k < NTIME; k++) {
+    sprintf(line, "%-10s | %10.4g | %6.2f | %.4g\n", names[k],
+            all[k] / comm->nprocs / nthreads,
+            total > 0.0 ? 100.0 * all[k] / total : 0.0,
+            1.0e9 * all[k] / natom);
+    msg += line;
+  }
+  sprintf(line, "Pair nnp counts: %.0f atoms, %.4g neighbors/atom, "
+                "%.4g triplets/atom\n",
+          all[NTIME + COUNT_ATOM], all[NTIME + COUNT_NEIGH] / natom,
+          all[NTIME + COUNT_TRIPLET] / natom);
+  msg += line;
+  sprintf(line, "Pair nnp peak scratch: %.4g Mbytes/proc\n",
+          all[NTIME + NCOUNT] / 1024.0 / 1024.0);
+  msg += line;
+
+  if (screen) fputs(msg.c_str(), screen);
+  if (logfile) fputs(msg.c_str(), logfile);
+}
+
+/* ----------------------------------------------------------------------
+   fraction of atoms reused from the cache, and the max error of a force
+   on J neighbors of reused atoms, which are evaluated on check steps
+------------------------------------------------------------------------- */
+
+void PairNNP::report_reuse() {
+  int t;
+  double one[3], all[3], ferr, ferrall;
+  char line[256];
+
+  one[0] = one[1] = one[2] = ferr = 0.0;
+  for (t = 0; t < (int)workspaces.size(); t++) {
+    one[0] += workspaces[t].nvisit;
+    one[1] += workspaces[t].nreuse;
+    one[2] += workspaces[t].ncheck;
+    ferr = MAX(ferr, workspaces[t].ferr);
+  }
+  MPI_Reduce(one, all, 3, MPI_DOUBLE, MPI_SUM, 0, world);
+  MPI_Reduce(&ferr, &ferrall, 1, MPI_DOUBLE, MPI_MAX, 0, world);
+  if (comm->me != 0) return;
+
+  sprintf(line, "\nPair nnp reuse: %.4g%% of %.0f atoms skipped, "
+                "max force error %g in %.0f checked atoms\n",
+          all[0] > 0.0 ? 100.0 * all[1] / all[0] : 0.0, all[0], ferrall,
+          all[2]);
+  if (screen) fputs(line, screen);
+  if (logfile) fputs(line, logfile);
+}
+
+/* ----------------------------------------------------------------------
+   stage times, counters and peak scratch bytes of all threads into pvector
+   in the order of TIME_*, COUNT_* and peak
+------------------------------------------------------------------------- */
+
+void PairNNP::sum_stats() {
+  int k, t;
+
+  for (k = 0; k < nextra; k++) pvector[k] = 0.0;
+  for (t = 0; t < (int)workspaces.size(); t++) {
+    Workspace &ws = workspaces[t];
+    for (k = 0; k < NTIME; k++) pvector[k] += ws.time[k];
+    for (k = 0; k < NCOUNT; k++) pvector[NTIME + k] += ws.count[k];
+    pvector[NTIME + NCOUNT] += ws.peak;
+  }
+}
+
+/* ----------------------------------------------------------------------
+   short neighbor list, scratch of all threads and NN parameters,
+   which are counted by no rank with shared yes
+------------------------------------------------------------------------- */
+
+double PairNNP::memory_usage() {
+  int i, l;
+  double bytes = Pair::memory_usage();
+
+  bytes += (double)maxlocal * (sizeof(int) + sizeof(int *));
+  bytes += (double)maxshort * sizeof(int);
+  for (i = 0; i < (int)workspaces.size(); i++)
+    bytes += workspaces[i].memory_usage();
+  if (reuse > 0.0) {
+    bytes += (double)maxlocal * (3 * sizeof(int) + sizeof(double));
+    bytes += (double)maxshort * (sizeof(int) + 6 * sizeof(double));
+  }
+  if (pairwise) {
+    bytes += (double)maxshort * 2 * sizeof(int);
+    bytes += (double)maxpair * nterm * sizeof(double);
+  }
+  bytes += (double)maxnnpatom * (2 + nnpatom * nfeature) * sizeof(double);
+  if (!shared) {
+    for (i = 0; i < (int)masters.size(); i++)
+      for (l = 0; l < (int)masters[i].layers.size(); l++)
+        bytes += masters[i].layers[l].size() * sizeof(double);
+    for (i = 0; i < (int)masters_single.size(); i++)
+      for (l = 0; l < (int)masters_single[i].layers.size(); l++)
+        bytes += masters_single[i].layers[l].size() * sizeof(float);
+  }
+  return bytes;
+}
+
+/* ----------------------------------------------------------------------
+   "timing" is pvector of timing yes, the same as in sum_stats()
+------------------------------------------------------------------------- */
+
+void *PairNNP::extract(const char *str, int &dim) {
+  dim = 1;
+  if (timing && strcmp(str, "timing") == 0) return (void *)pvector;
+  return NULL;
 }
 
 /* ----------------------------------------------------------------------
@@ -262,292 +634,994 @@ double PairNNP::init_one(int i, int j) {
   return cutmax;
 }
 
-/* ---------------------------------------------------------------------- */
+/* ----------------------------------------------------------------------
+   rank 0 parses a text potential file into a binary image, or maps
+   a binary potential file, and the image is broadcast at once
+------------------------------------------------------------------------- */
 
-void PairNNP::get_next_line(ifstream &fin, stringstream &ss, int &nwords) {
-  string line;
-  int n;
+void PairNNP::read_file(char *file) {
+  int i, l, status = 0, mapped = 0;
+  long size = 0, offset, chunk;
+  const char *data = NULL;
+  string err;
+  vector<char> image;
+  vector<double> recv;
 
-  // remove failbit
-  ss.clear();
-  // clear stringstream buffer
-  ss.str("");
+  if (comm->me == 0) {
+    if (is_binary_file(file)) {
+      status = map_file(file, data, size, err);
+      if (status == 0) {
+        mapped = 1;
+        status = check_image(data, size, err);
+      }
+    } else {
+      ifstream fin(file);
+      if (!fin) {
+        char str[128];
+        sprintf(str, "Cannot open neural network potential file %s", file);
+        error->one(FLERR, str);
+      }
+      status = text_to_image(fin, nelements, image, err);
+      data = &image[0];
+      size = image.size();
+    }
+    if (status) error->one(FLERR, err.c_str());
+  }
+
+  // receive into doubles so that arrays in the image are aligned
+  MPI_Bcast(&size, 1, MPI_LONG, 0, world);
+  if (comm->me != 0) {
+    recv.resize((size + sizeof(double) - 1) / sizeof(double));
+    data = (const char *)&recv[0];
+  }
+  // the count of MPI_Bcast is an int
+  for (offset = 0; offset < size; offset += chunk) {
+    chunk = MIN(size - offset, (long)INT_MAX);
+    MPI_Bcast((void *)(data + offset), (int)chunk, MPI_CHAR, 0, world);
+  }
 
-  if (comm->me == 0)
-    while (getline(fin, line))
-      if (!line.empty() && line[0] != '#') break;
+  // layers of the previous model may be in the window, drop all views
+  // over it before freeing it
+  masters.clear();
+  masters_single.clear();
+  free_shared();
+  status = read_image(data, size, err);
+  if (mapped) unmap_file(data, size);
+  if (status) error->all(FLERR, err.c_str());
+
+  if (fast)
+    for (i = 0; i < nelements; i++)
+      for (l = 0; l < (int)masters[i].layers.size(); l++)
+        masters[i].layers[l].approximate();
+
+  if (merge && npreprocess > 0) merge_preprocess();
+}
+
+/* ----------------------------------------------------------------------
+   NN of each element from the same NN of all committee members
+   the 1st layers are stacked in rows, so the symmetry functions are fed
+   to all members by one GEMM, and the other layers are block layers
+   whose k-th block is that of member k. the k-th output is the energy of
+   member k, and NNP::feedforward gives their mean and its dE/dG
+------------------------------------------------------------------------- */
 
-  n = line.size();
-  MPI_Bcast(&n, 1, MPI_INT, 0, world);
-  line.resize(n);
+void PairNNP::stack_committee(vector<vector<NNP<double> > > &members) {
+  int i, l, m, rows, cols;
+  MatrixXd weight;
+  VectorXd bias;
+
+  for (i = 0; i < nelements; i++) {
+    NNP<double> &first = members[0][i];
+
+    for (m = 1; m < nmodel; m++) {
+      NNP<double> &other = members[m][i];
+      int same = other.layers.size() == first.layers.size();
+      for (l = 0; same && l < (int)first.layers.size(); l++)
+        same = other.layers[l].weight.rows() ==
+                   first.layers[l].weight.rows() &&
+               other.layers[l].weight.cols() ==
+                   first.layers[l].weight.cols() &&
+               other.layers[l].activation_type() ==
+                   first.layers[l].activation_type();
+      if (!same) {
+        char str[128];
+        sprintf(str, "Committee members of element %s have different "
+                     "layers", elements[i].c_str());
+        error->all(FLERR, str);
+      }
+    }
 
-  MPI_Bcast(&line[0], n + 1, MPI_CHAR, 0, world);
-  nwords = atom->count_words(line.c_str());
-  ss << line;
+    masters[i] = first;
+    for (l = 0; l < (int)first.layers.size(); l++) {
+      rows = first.layers[l].weight.rows();
+      cols = first.layers[l].weight.cols();
+      weight.resize(nmodel * rows, cols);
+      bias.resize(nmodel * rows);
+      for (m = 0; m < nmodel; m++) {
+        weight.middleRows(m * rows, rows) = members[m][i].layers[l].weight;
+        bias.segment(m * rows, rows) = members[m][i].layers[l].bias;
+      }
+      masters[i].layers[l].set(weight, bias);
+      masters[i].layers[l].set_blocks(l == 0 ? 1 : nmodel);
+    }
+  }
 }
 
-void PairNNP::read_file(char *file) {
-  ifstream fin;
-  stringstream ss;
-  string sym_func_type, preprocess, element, activation;
-  int i, j, k, l, nwords;
-  int ntype, depth, depthnum, insize, outsize, size;
-  double Rc, eta, Rs, lambda, zeta;
-  vector<double> pca_transform_raw, pca_mean_raw;
-  vector<double> scl_max_raw, scl_min_raw;
-  vector<double> std_mean_raw, std_std_raw;
-  vector<double> weight, bias;
+/* ----------------------------------------------------------------------
+   standard deviation of the energies of committee members of the first
+   ws.nfresh I atoms of the batch into the custom property,
+   atoms reused from the cache keep their previous value
+------------------------------------------------------------------------- */
 
-  if (comm->me == 0) {
-    fin.open(file);
-    if (!fin) {
+void PairNNP::store_spread(int *ilist, int itype, Workspace &ws) {
+  int ib, m;
+  double mean, var, e;
+  double *spread = atom->dvector[ispread];
+  int depth = masters[itype].depth;
+
+  for (ib = 0; ib < ws.nfresh; ib++) {
+    mean = var = 0.0;
+    for (m = 0; m < nmodel; m++)
+      mean += mixed ? ws.nn_outf[depth - 1].coeff(m, ib)
+                    : ws.nn_out[depth - 1].coeff(m, ib);
+    mean /= nmodel;
+    for (m = 0; m < nmodel; m++) {
+      e = mixed ? ws.nn_outf[depth - 1].coeff(m, ib)
+                : ws.nn_out[depth - 1].coeff(m, ib);
+      var += (e - mean) * (e - mean);
+    }
+    spread[ilist[ib]] = sqrt(var / nmodel);
+  }
+}
+
+/* ----------------------------------------------------------------------
+   rows of nnpatom_values for local atoms, if this step stores them,
+   which is when compute nnp/atom is on and per-atom energy is tallied
+------------------------------------------------------------------------- */
+
+void PairNNP::grow_nnpatom() {
+  int ncol = 2 + nnpatom * nfeature;
+
+  nnpatom_now = nnpatom && evflag && eflag_atom;
+  if (!nnpatom_now) return;
+  if (atom->nmax > maxnnpatom) {
+    memory->destroy(nnpatom_values);
+    maxnnpatom = atom->nmax;
+    memory->create(nnpatom_values, maxnnpatom, ncol, "pair:nnpatom_values");
+  }
+  for (int i = 0; i < atom->nlocal; i++)
+    for (int k = 0; k < ncol; k++) nnpatom_values[i][k] = 0.0;
+}
+
+/* ----------------------------------------------------------------------
+   raw G of I atom, and the # of them outside the scaling range of
+   training, which is known only if scaling is the 1st preprocess
+------------------------------------------------------------------------- */
+
+void PairNNP::store_atom_G(int i, int itype, const VectorXd &G) {
+  int k, nout = 0;
+  double *row = nnpatom_values[i];
+
+  for (k = 0; k < nfeature; k++) row[2 + k] = G.coeff(k);
+  if (scl_raw)
+    for (k = 0; k < nfeature; k++)
+      if (G.coeff(k) < scl_min[itype].coeff(k) ||
+          G.coeff(k) > scl_max[itype].coeff(k))
+        nout++;
+  row[1] = nout;
+}
+
+/* ----------------------------------------------------------------------
+   atomic energies and dE/dG of the batch, all of its atoms are fresh
+------------------------------------------------------------------------- */
+
+void PairNNP::store_atom_batch(int *ilist, Workspace &ws) {
+  int ib, k;
+  double *row;
+
+  for (ib = 0; ib < ws.nfresh; ib++) {
+    row = nnpatom_values[ilist[ib]];
+    row[0] = ws.evdwls.coeff(ib);
+    if (nnpatom == 2)
+      for (k = 0; k < nfeature; k++)
+        row[2 + nfeature + k] = ws.dE_dGs.coeff(k, ib);
+  }
+}
+
+/* ----------------------------------------------------------------------
+   copy of NN in single precision for precision mixed
+   symmetry functions and their derivatives stay in double precision,
+   the input G, dE/dG and atomic energies of NN are rounded to float.
+   the error against double precision is estimated on pseudo-random G,
+   the same on all ranks, and tools/nnp_check measures it on a configuration
+------------------------------------------------------------------------- */
+
+void PairNNP::single_precision() {
+  int i;
+  double diff, norm;
+  MatrixXd Gs, dE_dG;
+  MatrixXf Gsf, dE_dGf;
+  VectorXd E;
+  VectorXf Ef;
+  vector<MatrixXd> out, deriv;
+  vector<MatrixXf> outf, derivf;
+  const int nprobe = 16;
+
+  masters_single.clear();
+  for (i = 0; i < nelements; i++) {
+    masters_single.push_back(NNP<float>(masters[i]));
+
+    Gs.resize(masters[i].layers[0].weight.cols(), nprobe);
+    probe(Gs, 12345 + i);
+    Gsf = Gs.cast<float>();
+    dE_dG.resize(Gs.rows(), nprobe);
+    dE_dGf.resize(Gs.rows(), nprobe);
+    E.resize(nprobe);
+    Ef.resize(nprobe);
+    masters[i].feedforward(Gs, dE_dG, 1, E, out, deriv);
+    masters_single[i].feedforward(Gsf, dE_dGf, 1, Ef, outf, derivf);
+
+    diff = MAX((E - Ef.cast<double>()).cwiseAbs().maxCoeff(),
+               (dE_dG - dE_dGf.cast<double>()).cwiseAbs().maxCoeff());
+    norm = MAX(1.0, MAX(E.cwiseAbs().maxCoeff(),
+                        dE_dG.cwiseAbs().maxCoeff()));
+    if (diff > NNP_MIXED_TOLERANCE * norm && comm->me == 0) {
       char str[128];
-      sprintf(str, "Cannot open neural network potential file %s", file);
-      error->one(FLERR, str);
+      sprintf(str, "Single precision NN of element %s deviates from double "
+                   "precision (max diff = %g)",
+              elements[i].c_str(), diff);
+      error->warning(FLERR, str);
     }
   }
+}
 
-  // symmetry function parameters
-  nG1params = 0;
-  nG2params = 0;
-  nG4params = 0;
-  get_next_line(fin, ss, nwords);
-  ss >> ntype;
-
-  for (i = 0; i < ntype; i++) {
-    get_next_line(fin, ss, nwords);
-    ss >> sym_func_type >> size;
-    if (sym_func_type == "type1") {
-      nG1params = size;
-      G1params = vector<vector<double> >(nG1params);
-      for (j = 0; j < nG1params; j++) {
-        get_next_line(fin, ss, nwords);
-        ss >> Rc;
-        G1params[j].push_back(Rc);
-      }
-    } else if (sym_func_type == "type2") {
-      nG2params = size;
-      G2params = vector<vector<double> >(nG2params);
-      for (j = 0; j < nG2params; j++) {
-        get_next_line(fin, ss, nwords);
-        ss >> Rc >> eta >> Rs;
-        G2params[j].push_back(Rc);
-        G2params[j].push_back(eta);
-        G2params[j].push_back(Rs);
-      }
-    } else if (sym_func_type == "type4") {
-      nG4params = size;
-      G4params = vector<vector<double> >(nG4params);
-      for (j = 0; j < nG4params; j++) {
-        get_next_line(fin, ss, nwords);
-        ss >> Rc >> eta >> lambda >> zeta;
-        G4params[j].push_back(Rc);
-        G4params[j].push_back(eta);
-        G4params[j].push_back(lambda);
-        G4params[j].push_back(zeta);
+/* ----------------------------------------------------------------------
+   one copy of NN parameters per node in an MPI-3 shared memory window
+   rank 0 of each node writes them, and the other ranks view the same memory
+------------------------------------------------------------------------- */
+
+void PairNNP::share_model() {
+#ifdef NNP_SHARED_MEMORY
+  int noderank, disp;
+  MPI_Aint bytes;
+  char *base;
+
+  MPI_Comm_split_type(world, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL,
+                      &nodecomm);
+  MPI_Comm_rank(nodecomm, &noderank);
+
+  bytes = share_layers(NULL, 0);
+  MPI_Win_allocate_shared(noderank == 0 ? bytes : 0, 1, MPI_INFO_NULL,
+                          nodecomm, &base, &modelwin);
+  MPI_Win_shared_query(modelwin, 0, &bytes, &disp, &base);
+
+  MPI_Win_fence(0, modelwin);
+  if (noderank == 0) share_layers(base, 1);
+  MPI_Win_fence(0, modelwin);
+  if (noderank != 0) share_layers(base, 0);
+#else
+  error->all(FLERR, "Pair style nnp shared yes requires MPI-3");
+#endif
+}
+
+/* ----------------------------------------------------------------------
+   layers of all elements in double, then in single precision,
+   each in a 64 byte aligned block from base
+   returns the total size, only counted if base is NULL
+------------------------------------------------------------------------- */
+
+long PairNNP::share_layers(char *base, int copy) {
+  int i, l;
+  long offset = 0;
+  const long align = 64;
+
+  for (i = 0; i < (int)masters.size(); i++)
+    for (l = 0; l < (int)masters[i].layers.size(); l++) {
+      Layer<double> &layer = masters[i].layers[l];
+      if (base) layer.share((double *)(base + offset), copy);
+      offset += (layer.size() * sizeof(double) + align - 1) / align * align;
+    }
+  for (i = 0; i < (int)masters_single.size(); i++)
+    for (l = 0; l < (int)masters_single[i].layers.size(); l++) {
+      Layer<float> &layer = masters_single[i].layers[l];
+      if (base) layer.share((float *)(base + offset), copy);
+      offset += (layer.size() * sizeof(float) + align - 1) / align * align;
+    }
+  return offset;
+}
+
+void PairNNP::free_shared() {
+#ifdef NNP_SHARED_MEMORY
+  if (modelwin != MPI_WIN_NULL) MPI_Win_free(&modelwin);
+  if (nodecomm != MPI_COMM_NULL) MPI_Comm_free(&nodecomm);
+#endif
+}
+
+/* ---------------------------------------------------------------------- */
+
+void PairNNP::setup_params() {
+  int i;
+  double err, derr, maxerr, maxderr;
+
+  setup(ntable, NNP_MOMENT_MAX_ZETA);
+
+  // tables of radial functions, checked against the analytic ones
+
+  if (ntable == 0) return;
+
+  maxerr = maxderr = 0.0;
+  for (i = 0; i < (int)radial_params.tables.size(); i++) {
+    radial_params.tables[i].error(radial_params.Rc[radial_params.iRc[i]],
+                                  radial_params.eta[i], radial_params.Rs[i],
+                                  err, derr);
+    maxerr = MAX(maxerr, err);
+    maxderr = MAX(maxderr, derr);
+  }
+  for (i = 0; i < (int)angular_params.tables.size(); i++) {
+    angular_params.tables[i].error(angular_params.Rc[i],
+                                   angular_params.eta[i], 0.0, err, derr);
+    maxerr = MAX(maxerr, err);
+    maxderr = MAX(maxderr, derr);
+  }
+
+  if (comm->me == 0) {
+    char str[128];
+    sprintf(str, "Pair nnp radial tables of %d intervals: max error %g, "
+                 "of derivative %g\n",
+            ntable, maxerr, maxderr);
+    if (screen) fputs(str, screen);
+    if (logfile) fputs(str, logfile);
+  }
+}
+
+/* ----------------------------------------------------------------------
+   weights of the per-atom cost, in seconds
+   with timing yes, measured on this rank so far: preprocess and NN per atom,
+   geometry, radial and force per neighbor, and angular per triplet,
+   or per neighbor if all G4 are expanded in moments,
+   so the costs of a rank add up to its time
+   otherwise, or before any atom is timed, estimated from the # of
+   floating point operations of each stage at 1 ns each
+------------------------------------------------------------------------- */
+
+void PairNNP::cost_weights() {
+  int i, l;
+  double natom, nneigh, ntriplet, flops;
+
+  if (timing) {
+    sum_stats();
+    natom = pvector[NTIME + COUNT_ATOM];
+    nneigh = pvector[NTIME + COUNT_NEIGH];
+    ntriplet = pvector[NTIME + COUNT_TRIPLET];
+    if (natom > 0.0 && nneigh > 0.0) {
+      cost_atom.assign(nelements, (pvector[TIME_PREPROCESS] +
+                                   pvector[TIME_NN]) / natom);
+      cost_neigh = (pvector[TIME_GEOMETRY] + pvector[TIME_RADIAL] +
+                    pvector[TIME_FORCE]) / nneigh;
+      cost_triplet = ntriplet > 0.0 ? pvector[TIME_ANGULAR] / ntriplet : 0.0;
+      if (ntriplet == 0.0) cost_neigh += pvector[TIME_ANGULAR] / nneigh;
+      return;
+    }
+  }
+
+  // NN forward and backward are 4 flops per weight,
+  // dG^T dE/dG is 6 flops per feature and neighbor
+
+  cost_atom.assign(nelements, 0.0);
+  for (i = 0; i < nelements; i++) {
+    flops = 0.0;
+    for (l = 0; l < (int)masters[i].layers.size(); l++)
+      flops += 4.0 * masters[i].layers[l].size();
+    cost_atom[i] = 1.0e-9 * flops;
+  }
+  cost_neigh = 1.0e-9 * (20.0 + 10.0 * (nG1params + nG2params) +
+                         6.0 * nfeature);
+  if (angular_params.nmoment)
+    cost_neigh += 1.0e-9 * 10.0 * angular_params.nmono *
+                  angular_params.eta.size() * (1 + nelements);
+  cost_triplet =
+      1.0e-9 * (20.0 + 12.0 * (nG4params - angular_params.nmoment));
+}
+
+/* ----------------------------------------------------------------------
+   cost of I atoms ilist[iifrom:iito] into the custom property,
+   as if they were all evaluated
+   atoms of NULL elements cost one neighbor, since balance needs weights > 0
+------------------------------------------------------------------------- */
+
+void PairNNP::store_cost(int iifrom, int iito) {
+  int i, j, ii, jj, jnum, itype, n3;
+  double delx, dely, delz;
+  int *jlist;
+  double **x = atom->x;
+  int *type = atom->type;
+  int *ilist = list->ilist;
+  double *cost = atom->dvector[icost];
+  double cut3sq = angular_params.Rcdense * angular_params.Rcdense;
+
+  for (ii = iifrom; ii < iito; ii++) {
+    i = ilist[ii];
+    itype = map[type[i]];
+    if (itype < 0) {
+      cost[i] = cost_neigh;
+      continue;
+    }
+    jlist = firstshort[i];
+    jnum = numshort[i];
+
+    n3 = 0;
+    for (jj = 0; jj < jnum; jj++) {
+      j = jlist[jj];
+      delx = x[i][0] - x[j][0];
+      dely = x[i][1] - x[j][1];
+      delz = x[i][2] - x[j][2];
+      if (delx * delx + dely * dely + delz * delz <= cut3sq) n3++;
+    }
+    cost[i] = cost_atom[itype] + cost_neigh * jnum +
+              cost_triplet * 0.5 * n3 * (n3 - 1);
+  }
+}
+
+/* ----------------------------------------------------------------------
+   storage of short neighbor list, only when LAMMPS reneighbors
+   J neighbors within cutmax are a subset of the full list,
+   so firstshort[i] has room for numneigh[i] entries
+------------------------------------------------------------------------- */
+
+void PairNNP::grow_short() {
+  int i, ii, n;
+  int inum = list->inum;
+  int *ilist = list->ilist;
+  int *numneigh = list->numneigh;
+
+  if (atom->nmax > maxlocal) {
+    maxlocal = atom->nmax;
+    memory->destroy(numshort);
+    memory->sfree(firstshort);
+    memory->create(numshort, maxlocal, "pair:numshort");
+    firstshort = (int **)memory->smalloc(maxlocal * sizeof(int *),
+                                         "pair:firstshort");
+  }
+
+  n = 0;
+  for (ii = 0; ii < inum; ii++) n += numneigh[ilist[ii]];
+  if (n > maxshort) {
+    maxshort = n + n / 4;
+    memory->destroy(shortneigh);
+    memory->create(shortneigh, maxshort, "pair:shortneigh");
+  }
+
+  n = 0;
+  for (ii = 0; ii < inum; ii++) {
+    i = ilist[ii];
+    firstshort[i] = &shortneigh[n];
+    n += numneigh[i];
+  }
+
+  if (reuse > 0.0) grow_cache();
+  if (pairwise) build_pairs();
+}
+
+/* ----------------------------------------------------------------------
+   slots of the pair buffer for entries of the full list
+   an entry of I owns a new slot if J is a ghost or J > I,
+   and an entry with J < I reads the slot of the entry of J for I,
+   or owns a new one if J has no such entry (J not in ilist)
+   incoming entries of each I are sorted by counting into owner and oslot
+------------------------------------------------------------------------- */
+
+void PairNNP::build_pairs() {
+  int i, j, ii, jj, k, jnum, offset;
+  int *jlist;
+  int nlocal = atom->nlocal;
+  int inum = list->inum;
+  int *ilist = list->ilist;
+  int *numneigh = list->numneigh;
+  int **firstneigh = list->firstneigh;
+  vector<int> start(nlocal + 1, 0), pos, owner, oslot, mark(nlocal, -1);
+
+  memory->grow(fullslot, maxshort, "pair:fullslot");
+  memory->grow(shortslot, maxshort, "pair:shortslot");
+
+  for (ii = 0; ii < inum; ii++) {
+    i = ilist[ii];
+    jlist = firstneigh[i];
+    jnum = numneigh[i];
+    for (jj = 0; jj < jnum; jj++) {
+      j = jlist[jj] & NEIGHMASK;
+      if (j < nlocal && j > i) start[j + 1]++;
+    }
+  }
+  for (i = 0; i < nlocal; i++) start[i + 1] += start[i];
+  pos.assign(start.begin(), start.end() - 1);
+  owner.resize(start[nlocal]);
+  oslot.resize(start[nlocal]);
+
+  npair = 0;
+  for (ii = 0; ii < inum; ii++) {
+    i = ilist[ii];
+    jlist = firstneigh[i];
+    jnum = numneigh[i];
+    offset = firstshort[i] - shortneigh;
+    for (jj = 0; jj < jnum; jj++) {
+      j = jlist[jj] & NEIGHMASK;
+      if (j < nlocal && j < i) continue;
+      fullslot[offset + jj] = npair;
+      if (j < nlocal) {
+        k = pos[j]++;
+        owner[k] = i;
+        oslot[k] = npair;
       }
+      npair++;
     }
   }
-  nfeature = ntwobody * (nG1params + nG2params) + nthreebody * nG4params;
-
-  // preprocess parameters
-  get_next_line(fin, ss, nwords);
-  ss >> npreprocess;
-
-  for (i = 0; i < npreprocess; i++) {
-    get_next_line(fin, ss, nwords);
-    ss >> preprocess;
-
-    if (preprocess == "pca") {
-      preprocesses.push_back(&PairNNP::pca);
-      pca_transform = vector<MatrixXd>(nelements);
-      pca_mean = vector<VectorXd>(nelements);
-      for (j = 0; j < nelements; j++) {
-        get_next_line(fin, ss, nwords);
-        ss >> element >> outsize >> insize;
-        pca_transform_raw = vector<double>(insize * outsize);
-        pca_mean_raw = vector<double>(insize);
-
-        for (k = 0; k < outsize; k++) {
-          get_next_line(fin, ss, nwords);
-          for (l = 0; ss >> pca_transform_raw[k * insize + l]; l++)
-            ;
-        }
 
-        get_next_line(fin, ss, nwords);
-        for (k = 0; ss >> pca_mean_raw[k]; k++)
-          ;
+  for (ii = 0; ii < inum; ii++) {
+    i = ilist[ii];
+    jlist = firstneigh[i];
+    jnum = numneigh[i];
+    offset = firstshort[i] - shortneigh;
+    for (k = start[i]; k < start[i + 1]; k++) mark[owner[k]] = oslot[k];
+    for (jj = 0; jj < jnum; jj++) {
+      j = jlist[jj] & NEIGHMASK;
+      if (j < nlocal && j < i)
+        fullslot[offset + jj] = mark[j] >= 0 ? -1 - mark[j] : npair++;
+    }
+    for (k = start[i]; k < start[i + 1]; k++) mark[owner[k]] = -1;
+  }
+
+  if (npair > maxpair) {
+    maxpair = npair + npair / 4;
+    memory->sfree(pairterm);
+    pairterm = (double *)memory->smalloc(
+        (bigint)maxpair * nterm * sizeof(double), "pair:pairterm");
+  }
+}
+
+/* ----------------------------------------------------------------------
+   radial terms of the slots owned by entries of the short list of
+   I atoms ilist[iifrom:iito], every step before any descriptor
+   entries of J < I read them, so all owners must be done first
+------------------------------------------------------------------------- */
 
-        for (k = 0; k < nelements; k++)
-          if (elements[k] == element) {
-            pca_transform[k] =
-                Map<MatrixXd>(&pca_transform_raw[0], insize, outsize).transpose();
-            pca_mean[k] = Map<VectorXd>(&pca_mean_raw[0], insize);
-          }
+void PairNNP::pair_terms(int iifrom, int iito, Workspace &ws) {
+  int i, j, ii, jj, jnum;
+  double delx, dely, delz;
+  int *jlist, *slot;
+  double **x = atom->x;
+  int *ilist = list->ilist;
+
+  lap(ws, -1);
+  for (ii = iifrom; ii < iito; ii++) {
+    i = ilist[ii];
+    jlist = firstshort[i];
+    jnum = numshort[i];
+    slot = &shortslot[jlist - shortneigh];
+    for (jj = 0; jj < jnum; jj++) {
+      if (slot[jj] < 0) continue;
+      j = jlist[jj];
+      delx = x[j][0] - x[i][0];
+      dely = x[j][1] - x[i][1];
+      delz = x[j][2] - x[i][2];
+      radial_terms(radial_params, angular_params,
+                   sqrt(delx * delx + dely * dely + delz * delz),
+                   &pairterm[(bigint)slot[jj] * nterm]);
+    }
+  }
+  lap(ws, TIME_RADIAL);
+}
+
+/* ----------------------------------------------------------------------
+   radial terms of J neighbors of I atom into ws.pterm
+------------------------------------------------------------------------- */
+
+void PairNNP::pair_pointers(int i, int jnum, Workspace &ws) {
+  int jj, s;
+  const int *slot = &shortslot[firstshort[i] - shortneigh];
+
+  for (jj = 0; jj < jnum; jj++) {
+    s = slot[jj] >= 0 ? slot[jj] : -1 - slot[jj];
+    ws.pterm[jj] = &pairterm[(bigint)s * nterm];
+  }
+}
+
+/* ----------------------------------------------------------------------
+   descriptor reuse cache in the layout of the short list,
+   invalidated since indices of atoms change by reneighboring
+------------------------------------------------------------------------- */
+
+void PairNNP::grow_cache() {
+  int i;
+
+  memory->grow(cacheflag, maxlocal, "pair:cacheflag");
+  memory->grow(cachehit, maxlocal, "pair:cachehit");
+  memory->grow(cachenum, maxlocal, "pair:cachenum");
+  memory->grow(cacheE, maxlocal, "pair:cacheE");
+  memory->grow(cachej, maxshort, "pair:cachej");
+  memory->grow(cacher, 3 * maxshort, "pair:cacher");
+  memory->grow(cacheF, 3 * maxshort, "pair:cacheF");
+  for (i = 0; i < maxlocal; i++) cacheflag[i] = 0;
+}
+
+/* ----------------------------------------------------------------------
+   1 if the cache of I atom has the same J neighbors and each r_ij moved
+   less than the tolerance, and has the energy if eflag is set
+------------------------------------------------------------------------- */
+
+int PairNNP::reusable(int i, int eflag) {
+  int j, jj, jnum;
+  double dx, dy, dz;
+  double **x = atom->x;
+  int *jlist = firstshort[i];
+  int offset = jlist - shortneigh;
+  const int *jcache = &cachej[offset];
+  const double *rcache = &cacher[3 * offset];
+  double reusesq = reuse * reuse;
+
+  jnum = numshort[i];
+  if (cacheflag[i] < (eflag ? 2 : 1) || cachenum[i] != jnum) return 0;
+
+  for (jj = 0; jj < jnum; jj++) {
+    j = jlist[jj];
+    if (j != jcache[jj]) return 0;
+    dx = x[j][0] - x[i][0] - rcache[3 * jj + 0];
+    dy = x[j][1] - x[i][1] - rcache[3 * jj + 1];
+    dz = x[j][2] - x[i][2] - rcache[3 * jj + 2];
+    if (dx * dx + dy * dy + dz * dz > reusesq) return 0;
+  }
+  return 1;
+}
+
+/* ----------------------------------------------------------------------
+   after NN, J neighbors, r_ij and energies of evaluated I atoms into
+   the cache, and r_ij and energies of reused I atoms from the cache
+   into their batch slots
+------------------------------------------------------------------------- */
+
+void PairNNP::cache_batch(int *ilist, int nb, int eflag, Workspace &ws) {
+  int i, ib, jj, jnum, offset;
+  int *jcache;
+  double *rcache, *rx, *ry, *rz;
+
+  for (ib = 0; ib < nb; ib++) {
+    i = ilist[ib];
+    jnum = numshort[i];
+    offset = firstshort[i] - shortneigh;
+    jcache = &cachej[offset];
+    rcache = &cacher[3 * offset];
+    rx = ws.r[3 * ib + 0].data();
+    ry = ws.r[3 * ib + 1].data();
+    rz = ws.r[3 * ib + 2].data();
+
+    if (ib < ws.nfresh) {
+      for (jj = 0; jj < jnum; jj++) {
+        jcache[jj] = firstshort[i][jj];
+        rcache[3 * jj + 0] = rx[jj];
+        rcache[3 * jj + 1] = ry[jj];
+        rcache[3 * jj + 2] = rz[jj];
       }
-    } else if (preprocess == "scaling") {
-      preprocesses.push_back(&PairNNP::scaling);
-      scl_max = vector<VectorXd>(nelements);
-      scl_min = vector<VectorXd>(nelements);
-
-      get_next_line(fin, ss, nwords);
-      ss >> scl_target_max >> scl_target_min;
-
-      for (j = 0; j < nelements; j++) {
-        get_next_line(fin, ss, nwords);
-        ss >> element >> size;
-        scl_max_raw = vector<double>(size);
-        scl_min_raw = vector<double>(size);
-
-        get_next_line(fin, ss, nwords);
-        for (k = 0; ss >> scl_max_raw[k]; k++)
-          ;
-
-        get_next_line(fin, ss, nwords);
-        for (k = 0; ss >> scl_min_raw[k]; k++)
-          ;
-
-        for (k = 0; k < nelements; k++)
-          if (elements[k] == element) {
-            scl_max[k] = Map<VectorXd>(&scl_max_raw[0], size);
-            scl_min[k] = Map<VectorXd>(&scl_min_raw[0], size);
-          }
+      cachenum[i] = jnum;
+      if (eflag) cacheE[i] = ws.evdwls.coeffRef(ib);
+      cacheflag[i] = eflag ? 2 : 1;
+    } else {
+      for (jj = 0; jj < jnum; jj++) {
+        rx[jj] = rcache[3 * jj + 0];
+        ry[jj] = rcache[3 * jj + 1];
+        rz[jj] = rcache[3 * jj + 2];
       }
-    } else if (preprocess == "standardization") {
-      preprocesses.push_back(&PairNNP::standardization);
-      std_mean = vector<VectorXd>(nelements);
-      std_std = vector<VectorXd>(nelements);
-
-      for (j = 0; j < nelements; j++) {
-        get_next_line(fin, ss, nwords);
-        ss >> element >> size;
-        std_mean_raw = vector<double>(size);
-        std_std_raw = vector<double>(size);
-
-        get_next_line(fin, ss, nwords);
-        for (k = 0; ss >> std_mean_raw[k]; k++)
-          ;
-
-        get_next_line(fin, ss, nwords);
-        for (k = 0; ss >> std_std_raw[k]; k++)
-          ;
-
-        for (k = 0; k < nelements; k++)
-          if (elements[k] == element) {
-            std_mean[k] = Map<VectorXd>(&std_mean_raw[0], size);
-            std_std[k] = Map<VectorXd>(&std_std_raw[0], size);
-          }
+      if (eflag) ws.evdwls.coeffRef(ib) = cacheE[i];
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------
+   forces on J neighbors of I atom in ws.F into the cache,
+   compared with the cache first if I atom could have been reused
+------------------------------------------------------------------------- */
+
+void PairNNP::store_force(int i, Workspace &ws) {
+  int jj, k, jnum = numshort[i];
+  double *Fcache = &cacheF[3 * (firstshort[i] - shortneigh)];
+
+  if (cachehit[i]) {
+    for (jj = 0; jj < jnum; jj++)
+      for (k = 0; k < 3; k++)
+        ws.ferr = MAX(ws.ferr, fabs(ws.F[k].coeffRef(jj) - Fcache[3 * jj + k]));
+    ws.ncheck += 1.0;
+  }
+  for (jj = 0; jj < jnum; jj++)
+    for (k = 0; k < 3; k++) Fcache[3 * jj + k] = ws.F[k].coeffRef(jj);
+}
+
+void PairNNP::restore_force(int i, Workspace &ws) {
+  int jj, k, jnum = numshort[i];
+  const double *Fcache = &cacheF[3 * (firstshort[i] - shortneigh)];
+
+  for (jj = 0; jj < jnum; jj++)
+    for (k = 0; k < 3; k++) ws.F[k].coeffRef(jj) = Fcache[3 * jj + k];
+}
+
+/* ----------------------------------------------------------------------
+   J neighbors within cutmax of I atoms ilist[iifrom:iito], every step
+   the full list also has atoms in the skin, which contribute nothing
+   I-J and J-I are both kept or both dropped, since their distances
+   are computed by the same operations
+------------------------------------------------------------------------- */
+
+void PairNNP::short_neighbor(int iifrom, int iito) {
+  int i, j, ii, jj, jnum, n, offset;
+  double xtmp, ytmp, ztmp, delx, dely, delz, rsq;
+  int *jlist, *neighshort;
+  double **x = atom->x;
+  int *ilist = list->ilist;
+  int *numneigh = list->numneigh;
+  int **firstneigh = list->firstneigh;
+  double cutmaxsq = cutmax * cutmax;
+
+  for (ii = iifrom; ii < iito; ii++) {
+    i = ilist[ii];
+    xtmp = x[i][0];
+    ytmp = x[i][1];
+    ztmp = x[i][2];
+    jlist = firstneigh[i];
+    jnum = numneigh[i];
+    neighshort = firstshort[i];
+
+    n = 0;
+    for (jj = 0; jj < jnum; jj++) {
+      j = jlist[jj];
+      j &= NEIGHMASK;
+      delx = xtmp - x[j][0];
+      dely = ytmp - x[j][1];
+      delz = ztmp - x[j][2];
+      rsq = delx * delx + dely * dely + delz * delz;
+      if (rsq < cutmaxsq) {
+        if (pairwise) {
+          offset = neighshort - shortneigh;
+          shortslot[offset + n] = fullslot[offset + jj];
+        }
+        neighshort[n++] = j;
       }
     }
+    numshort[i] = n;
+  }
+}
+
+/* ----------------------------------------------------------------------
+   I atoms ilist[0:inum] sorted by element into ws.ilists
+------------------------------------------------------------------------- */
+
+void PairNNP::sort_by_element(int *ilist, int inum, Workspace &ws) {
+  int i, ii, itype;
+  int *type = atom->type;
+
+  ws.ilists.resize(nelements);
+  for (itype = 0; itype < nelements; itype++) ws.ilists[itype].clear();
+  for (ii = 0; ii < inum; ii++) {
+    i = ilist[ii];
+    itype = map[type[i]];
+    if (itype >= 0) ws.ilists[itype].push_back(i);
   }
+}
 
-  // neural network parameters
-  get_next_line(fin, ss, nwords);
-  ss >> depth;
-  for (i = 0; i < nelements; i++) masters.push_back(NNP(depth));
+/* ----------------------------------------------------------------------
+   symmetry functions and NN for a batch of nb I atoms of element itype
+   ws.evdwls and ws.dE_dGs hold the results, ws.r and ws.dG_* the geometry,
+   ws.dG_* are not computed in the adjoint mode
+   with descriptor reuse, I atoms of the cache are moved to the end of ilist
+   and only the first ws.nfresh atoms are evaluated
+   only reads the potential parameters, so it is safe to call from threads
+------------------------------------------------------------------------- */
 
-  for (i = 0; i < nelements * depth; i++) {
-    get_next_line(fin, ss, nwords);
-    ss >> element >> depthnum >> insize >> outsize >> activation;
-    weight = vector<double>(insize * outsize);
-    bias = vector<double>(outsize);
+void PairNNP::batch(int itype, int *ilist, int nb, int eflag, Workspace &ws) {
+  int i, ib, n, jnum, maxneigh, ninput, check;
+  int *numneigh = numshort;
+  int **firstneigh = firstshort;
+
+  maxneigh = 0;
+  for (ib = 0; ib < nb; ib++) maxneigh = MAX(maxneigh, numneigh[ilist[ib]]);
+  ws.reserve(nfeature, radial_params.Rc.size(), maxneigh, nb, !adjoint);
+
+  // on check steps, atoms of the cache are evaluated to measure the error,
+  // and all atoms are evaluated when G is stored for compute nnp/atom
+
+  ws.nfresh = nb;
+  if (reuse > 0.0) {
+    check = reuse_check > 0 && update->ntimestep % reuse_check == 0;
+    n = 0;
+    for (ib = 0; ib < nb; ib++) {
+      i = ilist[ib];
+      cachehit[i] = reusable(i, eflag);
+      if (!cachehit[i] || check || nnpatom_now) {
+        ilist[ib] = ilist[n];
+        ilist[n++] = i;
+      }
+    }
+    ws.nfresh = n;
+    ws.nvisit += nb;
+    ws.nreuse += nb - n;
+  }
 
-    for (j = 0; j < insize; j++) {
-      get_next_line(fin, ss, nwords);
-      for (k = 0; ss >> weight[j * outsize + k]; k++)
-        ;
+  // NN buffers hold ws.nbatch atoms, only the first nb columns are used
+  ninput = masters[itype].layers[0].weight.cols();
+  if (ws.Gs.rows() != ninput || ws.Gs.cols() < nb) {
+    ws.Gs.resize(ninput, ws.nbatch);
+    ws.dE_dGs.resize(ninput, ws.nbatch);
+    ws.evdwls.resize(ws.nbatch);
+    if (mixed) {
+      ws.Gsf.resize(ninput, ws.nbatch);
+      ws.dE_dGsf.resize(ninput, ws.nbatch);
+      ws.evdwlsf.resize(ws.nbatch);
     }
+  }
 
-    get_next_line(fin, ss, nwords);
-    for (j = 0; ss >> bias[j]; j++)
-      ;
+  for (ib = 0; ib < ws.nfresh; ib++) {
+    i = ilist[ib];               // local index of I atom
+    jnum = numneigh[i];          // # of J neighbors of I atom
+    descriptor(i, itype, firstneigh[i], jnum, ib, ws);
+    ws.Gs.col(ib) = ws.G;
+    if (timing) {
+      ws.count[COUNT_NEIGH] += jnum;
+      ws.count[COUNT_TRIPLET] += ws.ntriplet;
+    }
+  }
 
-    for (j = 0; j < nelements; j++)
-      if (elements[j] == element)
-        masters[j].layers.push_back(Layer(insize, outsize, weight, bias, activation));
+  // one GEMM per layer for the whole batch
+
+  n = ws.nfresh;
+  lap(ws, -1);
+  if (n > 0 && mixed) {
+    ws.Gsf.leftCols(n) = ws.Gs.leftCols(n).cast<float>();
+    masters_single[itype].feedforward(
+        ws.Gsf.leftCols(n), ws.dE_dGsf.leftCols(n), eflag,
+        ws.evdwlsf.head(n), ws.nn_outf, ws.nn_derivf);
+    ws.dE_dGs.leftCols(n) = ws.dE_dGsf.leftCols(n).cast<double>();
+    if (eflag) ws.evdwls.head(n) = ws.evdwlsf.head(n).cast<double>();
+  } else if (n > 0)
+    masters[itype].feedforward(ws.Gs.leftCols(n), ws.dE_dGs.leftCols(n),
+                               eflag, ws.evdwls.head(n), ws.nn_out,
+                               ws.nn_deriv);
+  lap(ws, TIME_NN);
+
+  if (ispread >= 0) store_spread(ilist, itype, ws);
+  if (nnpatom_now) store_atom_batch(ilist, ws);
+  if (reuse > 0.0) cache_batch(ilist, nb, eflag, ws);
+
+  if (timing) {
+    ws.count[COUNT_ATOM] += n;
+    ws.peak = MAX(ws.peak, ws.memory_usage());
   }
-  if (comm->me == 0) fin.close();
 }
 
-/* ---------------------------------------------------------------------- */
+/* ----------------------------------------------------------------------
+   preprocessed symmetry functions G of I atom into ws.G and
+   their derivatives w.r.t. r_ij into ws.dG_* of batch slot ib
+   in the adjoint mode, only G and r_ij of batch slot ib
+------------------------------------------------------------------------- */
+
+void PairNNP::descriptor(int i, int itype, int *jlist, int jnum, int ib,
+                         Workspace &ws) {
+  int p;
+  VectorXd &G = ws.G;
+
+  lap(ws, -1);
+  if (adjoint) {
+    geometry(i, jlist, jnum, &ws.r[3 * ib], ws);
+    G.setZero(nfeature);
+    feature_index(jlist, jnum, ws);
+    if (pairwise) pair_pointers(i, jnum, ws);
+    lap(ws, TIME_GEOMETRY);
+    if (!ntable && !pairwise) cutoff(radial_params, jnum, ws);
+    radial_value(radial_params, jnum, ws, G);
+    lap(ws, TIME_RADIAL);
+    angular_value(angular_params, jnum, ws, G);
+    lap(ws, TIME_ANGULAR);
+    if (nnpatom_now) store_atom_G(i, itype, G);
+    return;
+  }
 
-void PairNNP::setup_params() {}
+  MatrixXd &dG_dx = ws.dG_dx[ib];
+  MatrixXd &dG_dy = ws.dG_dy[ib];
+  MatrixXd &dG_dz = ws.dG_dz[ib];
+
+  // preprocesses may have changed the shape of buffers at previous atom
+  if (npreprocess > 0 && dG_dx.rows() != nfeature) {
+    dG_dx.resize(nfeature, ws.nneigh);
+    dG_dy.resize(nfeature, ws.nneigh);
+    dG_dz.resize(nfeature, ws.nneigh);
+  }
+
+  geometry(i, jlist, jnum, &ws.r[3 * ib], ws);
+
+  G.setZero(nfeature);
+  dG_dx.leftCols(jnum).setZero();
+  dG_dy.leftCols(jnum).setZero();
+  dG_dz.leftCols(jnum).setZero();
+
+  feature_index(jlist, jnum, ws);
+  if (pairwise) pair_pointers(i, jnum, ws);
+  lap(ws, TIME_GEOMETRY);
+  if (!ntable && !pairwise) cutoff(radial_params, jnum, ws);
+  radial(radial_params, jnum, ws, G, dG_dx, dG_dy, dG_dz);
+  lap(ws, TIME_RADIAL);
+  angular(angular_params, jnum, ws, G, dG_dx, dG_dy, dG_dz);
+  lap(ws, TIME_ANGULAR);
+  if (nnpatom_now) store_atom_G(i, itype, G);
+
+  for (p = 0; p < npreprocess; p++) {
+    (this->*preprocesses[p])(itype, G, dG_dx, dG_dy, dG_dz);
+  }
+  lap(ws, TIME_PREPROCESS);
+}
+
+/* ----------------------------------------------------------------------
+   forces on J neighbors of I atom in batch slot ib into ws.F
+   in the adjoint mode, symmetry functions are evaluated again from r_ij
+   of the slot and each derivative is contracted with dE/dG on the fly,
+   so no nfeature x jnum matrix is built
+   I atoms reused by batch() take the forces of the cache
+------------------------------------------------------------------------- */
+
+void PairNNP::force_neighbors(int i, int ib, Workspace &ws) {
+  int k;
+  int jnum = numshort[i];
+
+  if (reuse > 0.0 && ib >= ws.nfresh) {
+    restore_force(i, ws);
+    return;
+  }
+
+  if (adjoint) {
+    const double *dE_dG = &ws.dE_dGs.coeffRef(0, ib);
+    for (k = 0; k < 3; k++) ws.F[k].head(jnum).setZero();
+    distance(jnum, &ws.r[3 * ib], ws);
+    triplet(angular_params.Rcdense, jnum, ws);
+    feature_index(firstshort[i], jnum, ws);
+    if (pairwise) pair_pointers(i, jnum, ws);
+    if (!ntable && !pairwise) cutoff(radial_params, jnum, ws);
+    radial_force(radial_params, jnum, ws, dE_dG);
+    angular_force(angular_params, jnum, ws, dE_dG);
+  } else {
+    ws.F[0].head(jnum).noalias() =
+        -1.0 * ws.dG_dx[ib].leftCols(jnum).transpose() * ws.dE_dGs.col(ib);
+    ws.F[1].head(jnum).noalias() =
+        -1.0 * ws.dG_dy[ib].leftCols(jnum).transpose() * ws.dE_dGs.col(ib);
+    ws.F[2].head(jnum).noalias() =
+        -1.0 * ws.dG_dz[ib].leftCols(jnum).transpose() * ws.dE_dGs.col(ib);
+  }
+
+  if (reuse > 0.0) store_force(i, ws);
+}
 
 /* ---------------------------------------------------------------------- */
 
-void PairNNP::geometry(int i, int *jlist, int jnum, VectorXd *r, VectorXd &R,
-                       MatrixXd &cos, VectorXd *dR, MatrixXd *dcos) {
+void PairNNP::geometry(int i, int *jlist, int jnum, VectorXd *r,
+                       Workspace &ws) {
   int jj, j;
   double **x = atom->x;
-  MatrixXd r_, dR_;
+  double *rx = r[0].data();
+  double *ry = r[1].data();
+  double *rz = r[2].data();
+
+  // gather r_ij into SoA buffers, the rest runs on them
 
-  r_ = MatrixXd(jnum, 3);
   for (jj = 0; jj < jnum; jj++) {
     j = jlist[jj];
-    r_.coeffRef(jj, 0) = x[j][0] - x[i][0];
-    r_.coeffRef(jj, 1) = x[j][1] - x[i][1];
-    r_.coeffRef(jj, 2) = x[j][2] - x[i][2];
+    rx[jj] = x[j][0] - x[i][0];
+    ry[jj] = x[j][1] - x[i][1];
+    rz[jj] = x[j][2] - x[i][2];
   }
 
-  R = r_.rowwise().norm();
-  dR_ = r_.array().colwise() / R.array();
-  cos.noalias() = dR_ * dR_.transpose();
-  for (i = 0; i < 3; i++) {
-    r[i] = r_.col(i);
-    dR[i] = dR_.col(i);
-    dcos[i] = ((cos.array().colwise() * dR[i].array() * (-1.0)).rowwise()
-               + dR[i].transpose().array()
-              ).colwise() * R.array().inverse();
-  }
+  distance(jnum, r, ws);
+  triplet(angular_params.Rcdense, jnum, ws);
 }
 
-void PairNNP::feature_index(int *jlist, int jnum, std::vector<int> &iG2s,
-                            vector< vector<int> > &iG3s) {
-  int i, j, itype, jtype;
+void PairNNP::feature_index(int *jlist, int jnum, Workspace &ws) {
+  int jj, t;
   int *type = atom->type;
-  iG2s = vector<int>(jnum);
-  iG3s = vector<vector<int> >(jnum, vector<int>(jnum));
-  for (i = 0; i < jnum; i++) {
-    itype = map[type[jlist[i]]];
-    iG2s[i] = itype;
-
-    for (j = 0; j < jnum; j++) {
-      jtype = map[type[jlist[j]]];
-      iG3s[i][j] = combinations[itype][jtype];
-    }
-  }
-}
 
-void PairNNP::pca(int type, VectorXd &G, MatrixXd &dG_dx, MatrixXd &dG_dy,
-                  MatrixXd &dG_dz) {
-  G = pca_transform[type] * (G - pca_mean[type]);
-  dG_dx = pca_transform[type] * dG_dx;
-  dG_dy = pca_transform[type] * dG_dy;
-  dG_dz = pca_transform[type] * dG_dz;
-}
-
-void PairNNP::scaling(int type, VectorXd &G, MatrixXd &dG_dx, MatrixXd &dG_dy,
-                      MatrixXd &dG_dz) {
-  G = ((G - scl_min[type]).array() *
-       (scl_max[type] - scl_min[type]).array().inverse() *
-       (scl_target_max - scl_target_min))
-          .array() +
-      scl_target_min;
-  dG_dx = dG_dx.array().colwise() *
-          (scl_max[type] - scl_min[type]).array().inverse() *
-          (scl_target_max - scl_target_min);
-  dG_dy = dG_dy.array().colwise() *
-          (scl_max[type] - scl_min[type]).array().inverse() *
-          (scl_target_max - scl_target_min);
-  dG_dz = dG_dz.array().colwise() *
-          (scl_max[type] - scl_min[type]).array().inverse() *
-          (scl_target_max - scl_target_min);
-}
-
-void PairNNP::standardization(int type, VectorXd &G, MatrixXd &dG_dx,
-                              MatrixXd &dG_dy, MatrixXd &dG_dz) {
-  G = (G - std_mean[type]).array() * std_std[type].array().inverse();
-  dG_dx = dG_dx.array().colwise() * std_std[type].array().inverse();
-  dG_dy = dG_dy.array().colwise() * std_std[type].array().inverse();
-  dG_dz = dG_dz.array().colwise() * std_std[type].array().inverse();
+  for (jj = 0; jj < jnum; jj++) ws.iG2s[jj] = map[type[jlist[jj]]];
+
+  for (t = 0; t < ws.ntriplet; t++)
+    ws.iG3s[t] = combinations[ws.iG2s[ws.tj[t]]][ws.iG2s[ws.tk[t]]];
 }
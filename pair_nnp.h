@@ -20,13 +20,17 @@ PairStyle(nnp, PairNNP)
 #ifndef LMP_PAIR_NNP_H
 #define LMP_PAIR_NNP_H
 
-#include "neural_network_potential.h"
+#include "nnp_model.h"
 #include "pair.h"
-#include "symmetry_function.h"
+
+// node-level shared memory windows need MPI-3, not in the STUBS library
+#if defined(MPI_VERSION) && MPI_VERSION >= 3
+#define NNP_SHARED_MEMORY
+#endif
 
 namespace LAMMPS_NS {
 
-class PairNNP : public Pair {
+class PairNNP : public Pair, protected NNPModel {
  public:
   PairNNP(class LAMMPS *);
 
@@ -42,51 +46,158 @@ class PairNNP : public Pair {
 
   virtual void init_style();
 
+  virtual void finish();
+
+  virtual double memory_usage();
+
+  void *extract(const char *, int &);
+
  protected:
-  double cutmax;               // max cutoff for all elements
-  int nelements;               // # of unique elements
-  int ntwobody;                // # of 2-body combinations
-  int nthreebody;              // # of 3-body combinations
-  vector<vector<int> > combinations;  // index of combination of 2 element
-  vector<string> elements;     // names of unique elements
+  friend class ComputeNNPAtom;
+
+  // names which Pair of newer LAMMPS also declares
+  using NNPModel::nelements;
+  using NNPModel::elements;
+
+  int nbatch;                  // max # of atoms fed to NN at once
+  int merge;                   // 1 if preprocesses are merged into NN
+  int adjoint;                 // 1 if forces are contracted without dG/dr
+  int mixed;                   // 1 if NN runs in single precision
+  int shared;                  // 1 if NN is shared by ranks of a node
+  int fast;                    // 1 if tanh and sigmoid are approximated
+  int timing;                  // 1 if stages are timed and counted
+  double reuse;                // tolerance of descriptor reuse, 0 if off
+  int reuse_check;             // reused forces are checked every this step
+  int ntable;                  // # of intervals of radial tables, 0 if off
+  int pairwise;                // 1 if radial terms are computed once a pair
+  string costname;             // custom per-atom property of cost, or empty
+  int icost;                   // index of costname in atom->dvector
+  string spreadname;           // custom per-atom property of committee
+                               // spread, or empty
+  int ispread;                 // index of spreadname in atom->dvector
+  int nmodel;                  // # of committee members (model files)
   vector<int> map;             // mapping from atom types to elements
-  vector<NNP> masters;         // parameter set for an I-J-K interaction
-  int nG1params, nG2params, nG4params;
-  vector<vector<double> > G1params, G2params, G4params;
-  int nfeature;
-  int npreprocess;
-  vector<MatrixXd> pca_transform;
-  vector<VectorXd> pca_mean;
-  vector<VectorXd> scl_max;
-  vector<VectorXd> scl_min;
-  double scl_target_max;
-  double scl_target_min;
-  vector<VectorXd> std_mean;
-  vector<VectorXd> std_std;
+  vector<NNP<float> > masters_single;  // masters in single precision
 
   virtual void allocate();
 
-  void get_next_line(ifstream &, stringstream &, int &);
-
   void read_file(char *);
 
+  void stack_committee(vector<vector<NNP<double> > > &);
+
+  void store_spread(int *, int, Workspace &);
+
+  void single_precision();
+
+#ifdef NNP_SHARED_MEMORY
+  MPI_Comm nodecomm;           // ranks of a node
+  MPI_Win modelwin;            // NN parameters of all ranks of a node
+#endif
+
+  void share_model();
+
+  long share_layers(char *, int);
+
+  void free_shared();
+
   virtual void setup_params();
 
-  void geometry(int, int *, int, VectorXd *, VectorXd &, MatrixXd &, VectorXd *,
-                MatrixXd *);
+  vector<Workspace> workspaces;  // per-thread scratch
+
+  int maxlocal;                // size of numshort and firstshort
+  int maxshort;                // size of shortneigh
+  int *numshort;               // # of J neighbors within cutmax
+  int **firstshort;            // J neighbors within cutmax
+  int *shortneigh;             // storage of firstshort
+
+  template <int EVFLAG, int EFLAG, int VFLAG_PAIR>
+  void eval();
+
+  // seconds since the previous lap into stage of ws, stage < 0 only starts
+  inline void lap(Workspace &ws, int stage) {
+    if (!timing) return;
+    double t = MPI_Wtime();
+    if (stage >= 0) ws.time[stage] += t - ws.tlap;
+    ws.tlap = t;
+  }
+
+  void sum_stats();
+
+  void report_timing();
+
+  void report_reuse();
+
+  // per-atom cache of descriptor reuse, in the layout of the short list
+  int *cacheflag;              // 0 if invalid, 1 forces, 2 forces and energy
+  int *cachehit;               // 1 if the cache passed the tolerance
+  int *cachenum;               // # of J neighbors when cached
+  double *cacheE;              // atomic energy
+  int *cachej;                 // J neighbors when cached
+  double *cacher;              // r_ij when cached, 3 per J
+  double *cacheF;              // forces on J neighbors, 3 per J
+
+  void grow_cache();
+
+  int reusable(int, int);
+
+  void cache_batch(int *, int, int, Workspace &);
+
+  void store_force(int, Workspace &);
+
+  void restore_force(int, Workspace &);
+
+  // cost of I atom = cost_atom[element] + cost_neigh * # of J neighbors
+  //                  + cost_triplet * # of J-K pairs within cutG4
+  vector<double> cost_atom;
+  double cost_neigh, cost_triplet;
+
+  void cost_weights();
+
+  void store_cost(int, int);
+
+  // per-atom values for compute nnp/atom, stored on steps of per-atom energy
+  // row of a local atom: energy, # of raw G outside the scaling range,
+  // raw G, and dE/dG if nnpatom is 2
+  int nnpatom;                 // 0 if off, 1 G, 2 G and dE/dG
+  int nnpatom_now;             // 1 if stored at this step
+  int maxnnpatom;              // # of rows of nnpatom_values
+  double **nnpatom_values;
+
+  void grow_nnpatom();
+
+  void store_atom_G(int, int, const VectorXd &);
+
+  void store_atom_batch(int *, Workspace &);
+
+  // radial terms shared by I-J and J-I, in slots of the pair buffer
+  // a slot < 0 of an entry is -1 - (slot of the entry of J that owns it)
+  int *fullslot;               // slot of each entry of the full list
+  int *shortslot;              // slot of each entry of the short list
+  int npair, maxpair;          // # of slots and capacity of pairterm
+  int nterm;                   // # of radial terms of a pair
+  double *pairterm;            // radial terms of each slot
+
+  void build_pairs();
+
+  void pair_terms(int, int, Workspace &);
+
+  void pair_pointers(int, int, Workspace &);
+
+  void grow_short();
+
+  void short_neighbor(int, int);
 
-  void feature_index(int *, int, std::vector<int> &, vector< vector<int> > &);
+  void sort_by_element(int *, int, Workspace &);
 
-  typedef void (PairNNP::*FuncPtr)(int, VectorXd &, MatrixXd &, MatrixXd &,
-                                   MatrixXd &);
+  void batch(int, int *, int, int, Workspace &);
 
-  vector<FuncPtr> preprocesses;
+  void descriptor(int, int, int *, int, int, Workspace &);
 
-  void pca(int, VectorXd &, MatrixXd &, MatrixXd &, MatrixXd &);
+  void force_neighbors(int, int, Workspace &);
 
-  void scaling(int, VectorXd &, MatrixXd &, MatrixXd &, MatrixXd &);
+  void geometry(int, int *, int, VectorXd *, Workspace &);
 
-  void standardization(int, VectorXd &, MatrixXd &, MatrixXd &, MatrixXd &);
+  void feature_index(int *, int, Workspace &);
 };
 
 }  // namespace LAMMPS_NS
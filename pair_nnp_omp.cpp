@@ -0,0 +1,153 @@
+/* ----------------------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   http://lammps.sandia.gov, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+#include "pair_nnp_omp.h"
+#include "atom.h"
+#include "comm.h"
+#include "neigh_list.h"
+#include "neighbor.h"
+#include "suffix.h"
+
+using namespace LAMMPS_NS;
+
+/* ---------------------------------------------------------------------- */
+
+PairNNPOMP::PairNNPOMP(LAMMPS *lmp) : PairNNP(lmp), ThrOMP(lmp, THR_PAIR) {
+  suffix_flag |= Suffix::OMP;
+  respa_enable = 0;
+}
+
+/* ---------------------------------------------------------------------- */
+
+void PairNNPOMP::compute(int eflag, int vflag) {
+  if (eflag || vflag)
+    ev_setup(eflag, vflag);
+  else
+    evflag = vflag_fdotr = 0;
+
+  const int nall = atom->nlocal + atom->nghost;
+  const int nthreads = comm->nthreads;
+  const int inum = list->inum;
+
+  if (neighbor->ago == 0) grow_short();
+  if (icost >= 0) cost_weights();
+  grow_nnpatom();
+
+#if defined(_OPENMP)
+#pragma omp parallel shared(eflag, vflag)
+#endif
+  {
+    int ifrom, ito, tid;
+
+    loop_setup_thr(ifrom, ito, tid, inum, nthreads);
+    ThrData *thr = fix->get_thr(tid);
+    thr->timer(Timer::START);
+    ev_setup_thr(eflag, vflag, nall, eatom, vatom, thr);
+
+    if (evflag) {
+      if (eflag) {
+        if (vflag_atom || vflag_global) eval<1, 1, 1>(ifrom, ito, thr);
+        else eval<1, 1, 0>(ifrom, ito, thr);
+      } else {
+        if (vflag_atom || vflag_global) eval<1, 0, 1>(ifrom, ito, thr);
+        else eval<1, 0, 0>(ifrom, ito, thr);
+      }
+    } else eval<0, 0, 0>(ifrom, ito, thr);
+    if (icost >= 0) store_cost(ifrom, ito);
+
+    thr->timer(Timer::PAIR);
+    reduce_thr(this, eflag, vflag, thr);
+  }  // end of omp parallel region
+
+  if (timing) sum_stats();
+}
+
+/* ----------------------------------------------------------------------
+   same as PairNNP::compute() for I atoms ilist[iifrom:iito]
+   each thread uses its own workspace, forces go to the thread's
+   own force array and are reduced by reduce_thr()
+------------------------------------------------------------------------- */
+
+template <int EVFLAG, int EFLAG, int VFLAG_PAIR>
+void PairNNPOMP::eval(int iifrom, int iito, ThrData *const thr) {
+  int i, j, ii, jj, ib, nb, inum, jnum;
+  int itype;
+  double fx, fy, fz;
+  int *jlist;
+  Workspace &ws = workspaces[thr->get_tid()];
+
+  double **f = thr->get_f();
+  int nlocal = atom->nlocal;
+
+  short_neighbor(iifrom, iito);
+
+  // radial terms of pairs owned by other threads are read below
+  if (pairwise) {
+    pair_terms(iifrom, iito, ws);
+#if defined(_OPENMP)
+#pragma omp barrier
+#endif
+  }
+  sort_by_element(&list->ilist[iifrom], iito - iifrom, ws);
+
+  for (itype = 0; itype < nelements; itype++) {
+    inum = ws.ilists[itype].size();
+    for (ii = 0; ii < inum; ii += nbatch) {
+      nb = MIN(nbatch, inum - ii);
+      batch(itype, &ws.ilists[itype][ii], nb, EFLAG, ws);
+
+      for (ib = 0; ib < nb; ib++) {
+        i = ws.ilists[itype][ii + ib];
+        jlist = firstshort[i];
+        jnum = numshort[i];
+        lap(ws, -1);
+        force_neighbors(i, ib, ws);
+
+        for (jj = 0; jj < jnum; jj++) {
+          j = jlist[jj];
+          fx = ws.F[0].coeffRef(jj);
+          fy = ws.F[1].coeffRef(jj);
+          fz = ws.F[2].coeffRef(jj);
+          f[j][0] += fx;
+          f[j][1] += fy;
+          f[j][2] += fz;
+          f[i][0] -= fx;
+          f[i][1] -= fy;
+          f[i][2] -= fz;
+
+          // force on J times r_ij is that on I times r_ji, as ev_tally_xyz
+          // expects, and the virial of the pair is split between I and J
+          if (EVFLAG && VFLAG_PAIR)
+            ev_tally_xyz_thr(this, i, j, nlocal, newton_pair, 0.0, 0.0,
+                             fx, fy, fz, ws.r[3 * ib + 0].coeffRef(jj),
+                             ws.r[3 * ib + 1].coeffRef(jj),
+                             ws.r[3 * ib + 2].coeffRef(jj), thr);
+        }
+
+        if (EVFLAG && EFLAG)
+          ev_tally_full_thr(this, i, 2.0 * ws.evdwls.coeffRef(ib), 0.0, 0.0,
+                            0.0, 0.0, 0.0, thr);
+        lap(ws, TIME_FORCE);
+      }
+    }
+  }
+}
+
+/* ---------------------------------------------------------------------- */
+
+double PairNNPOMP::memory_usage() {
+  double bytes = memory_usage_thr();
+  bytes += PairNNP::memory_usage();
+
+  return bytes;
+}
@@ -0,0 +1,339 @@
+//
+// binary image of a potential file
+//
+
+#include "potential_file.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sstream>
+
+ImageWriter::ImageWriter(vector<char> &image_) : image(image_) {
+  image.assign(NNP_BINARY_HEADER, 0);
+  memcpy(&image[0], NNP_BINARY_MAGIC, 8);
+  int32_t version = NNP_BINARY_VERSION;
+  memcpy(&image[8], &version, sizeof(int32_t));
+}
+
+void ImageWriter::put_int(int i) {
+  int32_t i32 = i;
+  const char *p = (const char *)&i32;
+  image.insert(image.end(), p, p + sizeof(int32_t));
+}
+
+void ImageWriter::put_string(const string &s) {
+  put_int(s.size());
+  image.insert(image.end(), s.begin(), s.end());
+}
+
+void ImageWriter::put_array(const double *v, int n) {
+  put_int(n);
+  image.resize((image.size() + NNP_BINARY_ALIGN - 1) / NNP_BINARY_ALIGN *
+               NNP_BINARY_ALIGN, 0);
+  const char *p = (const char *)v;
+  image.insert(image.end(), p, p + n * sizeof(double));
+}
+
+// total size into the header
+void ImageWriter::finish() {
+  int64_t size = image.size();
+  memcpy(&image[16], &size, sizeof(int64_t));
+}
+
+ImageReader::ImageReader(const char *data_, long size_) {
+  data = data_;
+  size = size_;
+  pos = NNP_BINARY_HEADER;
+  failed = 0;
+}
+
+int ImageReader::get_int() {
+  int32_t i32 = 0;
+
+  if (pos + (long)sizeof(int32_t) > size) {
+    failed = 1;
+    return 0;
+  }
+  memcpy(&i32, data + pos, sizeof(int32_t));
+  pos += sizeof(int32_t);
+  return i32;
+}
+
+string ImageReader::get_string() {
+  int n = get_int();
+
+  if (n < 0 || pos + n > size) {
+    failed = 1;
+    return string();
+  }
+  pos += n;
+  return string(data + pos - n, n);
+}
+
+const double *ImageReader::get_array(int &n) {
+  n = get_int();
+  pos = (pos + NNP_BINARY_ALIGN - 1) / NNP_BINARY_ALIGN * NNP_BINARY_ALIGN;
+  if (n < 0 || pos + n * (long)sizeof(double) > size) {
+    failed = 1;
+    n = 0;
+    return NULL;
+  }
+  pos += n * sizeof(double);
+  return (const double *)(data + pos - n * sizeof(double));
+}
+
+int check_image(const char *data, long size, string &err) {
+  int32_t version;
+  int64_t size_;
+
+  if (size < NNP_BINARY_HEADER || memcmp(data, NNP_BINARY_MAGIC, 8) != 0) {
+    err = "Not a binary neural network potential file";
+    return 1;
+  }
+  memcpy(&version, data + 8, sizeof(int32_t));
+  memcpy(&size_, data + 16, sizeof(int64_t));
+  if (version != NNP_BINARY_VERSION) {
+    err = "Unsupported version of binary neural network potential file";
+    return 1;
+  }
+  if (size_ != size) {
+    err = "Truncated binary neural network potential file";
+    return 1;
+  }
+  return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+
+// next line which is not blank nor a comment, CR of CRLF is removed
+static void next_line(istream &fin, stringstream &ss) {
+  string line;
+
+  ss.clear();
+  ss.str("");
+  while (getline(fin, line)) {
+    if (!line.empty() && line[line.size() - 1] == '\r')
+      line.erase(line.size() - 1);
+    if (line.find_first_not_of(" \t") != string::npos && line[0] != '#')
+      break;
+  }
+  ss << line;
+}
+
+// 1 if a rows x cols array can't be of a potential file
+static int bad_size(int rows, int cols) {
+  return rows < 0 || cols < 0 || (long)rows * cols > NNP_MAX_VALUES;
+}
+
+// first n values of the line, 0 on success
+static int get_values(stringstream &ss, double *v, int n) {
+  int k;
+
+  for (k = 0; k < n; k++)
+    if (!(ss >> v[k])) return 1;
+  return 0;
+}
+
+int text_to_image(istream &fin, int nelements, vector<char> &image,
+                  string &err) {
+  stringstream ss;
+  string sym_func_type, preprocess, element, activation;
+  int i, j, k, nvalue, ok;
+  int ntype, npreprocess, depth, depthnum, insize, outsize, size;
+  vector<double> v, w;
+  ImageWriter out(image);
+
+  ok = 1;
+  ntype = npreprocess = depth = 0;
+
+  // symmetry function parameters
+  next_line(fin, ss);
+  ok &= (bool)(ss >> ntype);
+  out.put_int(ntype);
+  for (i = 0; ok && i < ntype; i++) {
+    next_line(fin, ss);
+    ok &= (bool)(ss >> sym_func_type);
+    if (!ok) break;
+    // cutoff function of all symmetry functions, by its name
+    if (sym_func_type == "cutoff") {
+      ok &= (bool)(ss >> element);
+      out.put_string(sym_func_type);
+      out.put_string(element);
+      continue;
+    }
+    ok &= (bool)(ss >> size);
+    if (!ok) break;
+    if (sym_func_type == "type1")
+      nvalue = 1;                // Rc
+    else if (sym_func_type == "type2")
+      nvalue = 3;                // Rc eta Rs
+    else if (sym_func_type == "type4")
+      nvalue = 4;                // Rc eta lambda zeta
+    else {
+      err = "Unknown symmetry function " + sym_func_type;
+      return 1;
+    }
+    if (bad_size(size, nvalue)) {
+      err = "Inconsistent neural network potential file";
+      return 1;
+    }
+    v.resize(size * nvalue);
+    for (j = 0; ok && j < size; j++) {
+      next_line(fin, ss);
+      ok &= !get_values(ss, &v[j * nvalue], nvalue);
+    }
+    out.put_string(sym_func_type);
+    out.put_int(size);
+    out.put_array(v.data(), size * nvalue);
+  }
+
+  // preprocess parameters
+  // each element block is written with its element name,
+  // elements are mapped to atom types when the image is loaded
+  next_line(fin, ss);
+  ok &= (bool)(ss >> npreprocess);
+  out.put_int(npreprocess);
+  for (i = 0; ok && i < npreprocess; i++) {
+    next_line(fin, ss);
+    preprocess.clear();
+    ss >> preprocess;
+    out.put_string(preprocess);
+
+    if (preprocess == "pca") {
+      out.put_int(nelements);
+      for (j = 0; ok && j < nelements; j++) {
+        next_line(fin, ss);
+        ok &= (bool)(ss >> element >> outsize >> insize);
+        if (!ok) break;
+        if (bad_size(outsize, insize)) {
+          err = "Inconsistent neural network potential file";
+          return 1;
+        }
+        v.resize(insize * outsize);
+        w.resize(insize);
+        for (k = 0; ok && k < outsize; k++) {
+          next_line(fin, ss);
+          ok &= !get_values(ss, &v[k * insize], insize);
+        }
+        next_line(fin, ss);
+        ok &= !get_values(ss, w.data(), insize);
+        out.put_string(element);
+        out.put_int(outsize);
+        out.put_int(insize);
+        out.put_array(v.data(), insize * outsize);
+        out.put_array(w.data(), insize);
+      }
+    } else if (preprocess == "scaling" || preprocess == "standardization") {
+      if (preprocess == "scaling") {
+        v.resize(2);
+        next_line(fin, ss);
+        ok &= !get_values(ss, v.data(), 2);  // target max & min
+        out.put_array(v.data(), 2);
+      }
+      out.put_int(nelements);
+      for (j = 0; ok && j < nelements; j++) {
+        next_line(fin, ss);
+        ok &= (bool)(ss >> element >> size);
+        if (!ok) break;
+        if (bad_size(size, 1)) {
+          err = "Inconsistent neural network potential file";
+          return 1;
+        }
+        v.resize(size);
+        w.resize(size);
+        next_line(fin, ss);
+        ok &= !get_values(ss, v.data(), size);
+        next_line(fin, ss);
+        ok &= !get_values(ss, w.data(), size);
+        out.put_string(element);
+        out.put_int(size);
+        out.put_array(v.data(), size);
+        out.put_array(w.data(), size);
+      }
+    } else {
+      err = "Unknown preprocess " + preprocess;
+      return 1;
+    }
+  }
+
+  // neural network parameters
+  next_line(fin, ss);
+  ok &= (bool)(ss >> depth);
+  out.put_int(depth);
+  out.put_int(nelements * depth);
+  for (i = 0; ok && i < nelements * depth; i++) {
+    next_line(fin, ss);
+    ok &= (bool)(ss >> element >> depthnum >> insize >> outsize >> activation);
+    if (!ok) break;
+    if (bad_size(insize, outsize)) {
+      err = "Inconsistent neural network potential file";
+      return 1;
+    }
+    v.resize(insize * outsize);
+    w.resize(outsize);
+    for (j = 0; ok && j < insize; j++) {
+      next_line(fin, ss);
+      ok &= !get_values(ss, &v[j * outsize], outsize);
+    }
+    next_line(fin, ss);
+    ok &= !get_values(ss, w.data(), outsize);
+    out.put_string(element);
+    out.put_int(depthnum);
+    out.put_int(insize);
+    out.put_int(outsize);
+    out.put_string(activation);
+    out.put_array(v.data(), insize * outsize);
+    out.put_array(w.data(), outsize);
+  }
+
+  if (!ok) {
+    err = "Incomplete neural network potential file";
+    return 1;
+  }
+  out.finish();
+  return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+
+int is_binary_file(const char *file) {
+  char magic[8];
+  int binary = 0;
+  FILE *fp = fopen(file, "rb");
+
+  if (fp == NULL) return 0;
+  if (fread(magic, 1, 8, fp) == 8 && memcmp(magic, NNP_BINARY_MAGIC, 8) == 0)
+    binary = 1;
+  fclose(fp);
+  return binary;
+}
+
+int map_file(const char *file, const char *&data, long &size, string &err) {
+  struct stat st;
+  void *p;
+  int fd = open(file, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0) close(fd);
+    err = string("Cannot open neural network potential file ") + file;
+    return 1;
+  }
+  size = st.st_size;
+  p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    err = string("Cannot map neural network potential file ") + file;
+    return 1;
+  }
+  data = (const char *)p;
+  return 0;
+}
+
+void unmap_file(const char *data, long size) {
+  munmap((void *)data, size);
+}
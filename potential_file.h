@@ -0,0 +1,77 @@
+//
+// binary image of a potential file
+//
+
+#ifndef HDNNP_LAMMPS_POTENTIAL_FILE_H
+#define HDNNP_LAMMPS_POTENTIAL_FILE_H
+
+#include <istream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#define NNP_BINARY_MAGIC "HDNNPBIN"
+#define NNP_BINARY_VERSION 1
+#define NNP_BINARY_HEADER 64
+#define NNP_BINARY_ALIGN 8
+
+// max # of values of one array of a text potential file, larger sizes are
+// reported as broken instead of allocated
+#define NNP_MAX_VALUES (1L << 26)
+
+// a potential file is parsed once into an image, a contiguous buffer
+// which is broadcast at once or mapped from a binary potential file.
+// layout (integers are int32, reals are double):
+//   header : magic[8], version, 0, size in bytes (int64), padded to 64 bytes
+//   body   : fields in the same order as the text format
+// a string is its length and characters,
+// an array is its length and values, which start at an 8 byte boundary
+// so that they can be read as doubles. the values are copied into the
+// parameters, the image is not used after reading.
+
+class ImageWriter {
+ public:
+  vector<char> &image;
+
+  ImageWriter(vector<char> &);
+
+  void put_int(int);
+
+  void put_string(const string &);
+
+  void put_array(const double *, int);
+
+  void finish();
+};
+
+class ImageReader {
+ public:
+  const char *data;
+  long size, pos;
+  int failed;                  // 1 if any field is beyond the end
+
+  ImageReader(const char *, long);
+
+  int get_int();
+
+  string get_string();
+
+  const double *get_array(int &);
+};
+
+// check the header, 0 on success
+int check_image(const char *, long, string &);
+
+// parse a text potential file for nelements elements, 0 on success
+int text_to_image(istream &, int, vector<char> &, string &);
+
+// 1 if the file starts with the magic of binary format
+int is_binary_file(const char *);
+
+// read-only mapping of a whole file, 0 on success
+int map_file(const char *, const char *&, long &, string &);
+
+void unmap_file(const char *, long);
+
+#endif  // HDNNP_LAMMPS_POTENTIAL_FILE_H
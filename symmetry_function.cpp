@@ -4,101 +4,1204 @@
 
 #include "symmetry_function.h"
 
-void G1(vector<double> params, int iparam, vector<int> iG2s, int numneigh,
-        VectorXd &R, VectorXd *dR, VectorXd &G, MatrixXd &dG_dx, MatrixXd &dG_dy, MatrixXd &dG_dz) {
-  int j, iG;
-  VectorXd tanh, coeff, g, dg[3];
-  double Rc = params[0];
-
-  tanh = (1.0 - R.array() / Rc).tanh();
-  g = tanh.array().cube();
-  coeff = -3.0 / Rc * (1.0 - tanh.array().square()) * tanh.array().square();
-  dg[0] = coeff.array() * dR[0].array();
-  dg[1] = coeff.array() * dR[1].array();
-  dg[2] = coeff.array() * dR[2].array();
+#include <algorithm>
+#include <cmath>
+
+int cutoff_type(const string &name) {
+  const char *names[NCUTOFF] = {"tanh3", "cos", "poly1", "poly2", "poly3",
+                                "poly4"};
+
+  for (int t = 0; t < NCUTOFF; t++)
+    if (name == names[t]) return t;
+  return -1;
+}
+
+RadialParams::RadialParams() { fctype = CUTOFF_TANH3; }
+
+int RadialParams::cutoff_index(double Rc_) {
+  int i;
+
+  for (i = 0; i < (int)Rc.size(); i++)
+    if (Rc[i] == Rc_) return i;
+  Rc.push_back(Rc_);
+  return i;
+}
+
+void RadialParams::add(double Rc_, double eta_, double Rs_, int iparam_) {
+  iRc.push_back(cutoff_index(Rc_));
+  eta.push_back(eta_);
+  Rs.push_back(Rs_);
+  iparam.push_back(iparam_);
+}
+
+// tables of all sets with n intervals each
+void RadialParams::tabulate(int n) {
+  int p;
+
+  tables = vector<RadialTable>(eta.size());
+  for (p = 0; p < (int)eta.size(); p++)
+    tables[p].build(fctype, Rc[iRc[p]], eta[p], Rs[p], n);
+}
+
+AngularParams::AngularParams() {
+  nmoment = 0;
+  Rcdense = Rcmoment = 0.0;
+  nelement = 0;
+  maxdegree = 0;
+  nmono = 0;
+}
+
+// a G4 set of Rc (index iRc in RadialParams), eta, lambda and zeta
+// whose features start at iparam_, over the J-K pair list until expand()
+void AngularParams::add(double Rc_, int iRc_, double eta_, double lambda_,
+                        double zeta_, int iparam_) {
+  int r, a;
+
+  for (r = 0; r < (int)eta.size(); r++)
+    if (iRc[r] == iRc_ && eta[r] == eta_) break;
+  if (r == (int)eta.size()) {
+    Rc.push_back(Rc_);
+    iRc.push_back(iRc_);
+    eta.push_back(eta_);
+  }
+  for (a = 0; a < (int)lambda.size(); a++)
+    if (lambda[a] == lambda_ && zeta[a] == zeta_) break;
+  if (a == (int)lambda.size()) {
+    lambda.push_back(lambda_);
+    zeta.push_back(zeta_);
+    izeta.push_back(zeta_ >= 1.0 && zeta_ <= 1024.0 && zeta_ == floor(zeta_)
+                        ? (int)zeta_ : 0);
+    moment.push_back(0);
+  }
+  irad.push_back(r);
+  iang.push_back(a);
+  iparam.push_back(iparam_);
+  Rcdense = max(Rcdense, Rc_);
+}
+
+// tables of all radial parts with n intervals each, cutoff function of
+// type fctype of RadialParams
+void AngularParams::tabulate(int n, int fctype) {
+  int r;
+
+  tables = vector<RadialTable>(eta.size());
+  for (r = 0; r < (int)eta.size(); r++)
+    tables[r].build(fctype, Rc[r], eta[r], 0.0, n);
+}
+
+// angular parts of integer zeta up to maxzeta (0 for none, at most
+// NNP_MOMENT_MAX_ZETA) are expanded in moments, with G4 indices of 2
+// elements of J neighbors in combinations.
+// monomials are in increasing degree, so those of degree up to n are the
+// first (n + 1)(n + 2)(n + 3) / 6
+void AngularParams::expand(int maxzeta,
+                           const vector<vector<int> > &combinations) {
+  int a, s, m, n, d, e, ax, ay, az;
+  vector<int> index;
+
+  maxzeta = min(maxzeta, NNP_MOMENT_MAX_ZETA);
+  nelement = combinations.size();
+  combination.resize(nelement * nelement);
+  for (e = 0; e < nelement * nelement; e++)
+    combination[e] = combinations[e / nelement][e % nelement];
+
+  maxdegree = 0;
+  for (a = 0; a < (int)lambda.size(); a++) {
+    moment[a] = izeta[a] > 0 && izeta[a] <= maxzeta;
+    if (moment[a]) maxdegree = max(maxdegree, izeta[a]);
+  }
+  nmoment = 0;
+  Rcdense = Rcmoment = 0.0;
+  for (s = 0; s < (int)iparam.size(); s++) {
+    if (moment[iang[s]]) {
+      nmoment++;
+      Rcmoment = max(Rcmoment, Rc[irad[s]]);
+    } else
+      Rcdense = max(Rcdense, Rc[irad[s]]);
+  }
+
+  // exponents of each degree, ax and then ay in decreasing order
+  n = maxdegree + 1;
+  index.assign(n * n * n, 0);
+  mdegree.clear();
+  mprev.clear();
+  maxis.clear();
+  mmult.clear();
+  for (d = 0; d < 3; d++) {
+    mdown[d].clear();
+    mexp[d].clear();
+  }
+  for (m = n = 0; n <= maxdegree; n++)
+    for (ax = n; ax >= 0; ax--)
+      for (ay = n - ax; ay >= 0; ay--, m++) {
+        az = n - ax - ay;
+        index[(ax * (maxdegree + 1) + ay) * (maxdegree + 1) + az] = m;
+        mdegree.push_back(n);
+        mexp[0].push_back(ax);
+        mexp[1].push_back(ay);
+        mexp[2].push_back(az);
+        mmult.push_back(tgamma(n + 1.0) /
+                        (tgamma(ax + 1.0) * tgamma(ay + 1.0) *
+                         tgamma(az + 1.0)));
+      }
+  nmono = mdegree.size();
+
+  for (m = 0; m < nmono; m++) {
+    int ex[3] = {(int)mexp[0][m], (int)mexp[1][m], (int)mexp[2][m]};
+    for (d = 0; d < 3; d++) {
+      if (ex[d] == 0) {
+        mdown[d].push_back(0);
+        continue;
+      }
+      ex[d]--;
+      mdown[d].push_back(
+          index[(ex[0] * (maxdegree + 1) + ex[1]) * (maxdegree + 1) + ex[2]]);
+      ex[d]++;
+    }
+    d = 0;
+    while (d < 3 && ex[d] == 0) d++;
+    maxis.push_back(d < 3 ? d : 0);
+    mprev.push_back(d < 3 ? mdown[d][m] : 0);
+  }
+
+  mcoeff.setZero(maxdegree + 1, lambda.size());
+  mdiag.assign(lambda.size(), 0.0);
+  for (a = 0; a < (int)lambda.size(); a++) {
+    if (!moment[a]) continue;
+    double c = pow(2.0, 1 - zeta[a]);
+    for (n = 0; n <= izeta[a]; n++) {
+      mcoeff(n, a) = c;
+      c *= lambda[a] * (izeta[a] - n) / (n + 1);
+    }
+    mdiag[a] = pow(2.0, 1 - zeta[a]) * pow(1.0 + lambda[a], zeta[a]);
+  }
+}
+
+RadialTable::RadialTable() {
+  n = 0;
+  scale = 0.0;
+  fctype = CUTOFF_TANH3;
+}
+
+// exp(-eta * (R - Rs)^2) * fc(R) and its 1st and 2nd derivatives
+static void radial_exact(int fctype, double Rc, double eta, double Rs,
+                         double R, double *y) {
+  double f[3], e, de, d2e;
+
+  if (R > Rc) {
+    y[0] = y[1] = y[2] = 0.0;
+    return;
+  }
+  cutoff_function(fctype, R, Rc, f);
+  e = exp(-eta * (R - Rs) * (R - Rs));
+  de = -2.0 * eta * (R - Rs) * e;
+  d2e = (4.0 * eta * eta * (R - Rs) * (R - Rs) - 2.0 * eta) * e;
+  y[0] = e * f[0];
+  y[1] = de * f[0] + e * f[1];
+  y[2] = d2e * f[0] + 2.0 * de * f[1] + e * f[2];
+}
+
+void RadialTable::build(int fctype_, double Rc, double eta, double Rs,
+                        int n_) {
+  int i;
+  double h, dy, d0, d1, s0, s1, y0[3], y1[3];
+
+  fctype = fctype_;
+  n = n_;
+  h = Rc / n;
+  scale = n / Rc;
+  coeff.resize(6 * n);
+
+  // derivatives w.r.t. t = (R - R_i) / h in [0, 1]
+  radial_exact(fctype, Rc, eta, Rs, 0.0, y1);
+  for (i = 0; i < n; i++) {
+    y0[0] = y1[0];
+    y0[1] = y1[1];
+    y0[2] = y1[2];
+    radial_exact(fctype, Rc, eta, Rs, (i + 1) * h, y1);
+    dy = y1[0] - y0[0];
+    d0 = h * y0[1];
+    d1 = h * y1[1];
+    s0 = h * h * y0[2];
+    s1 = h * h * y1[2];
+    double *c = &coeff[6 * i];
+    c[0] = y0[0];
+    c[1] = d0;
+    c[2] = 0.5 * s0;
+    c[3] = 10.0 * dy - 6.0 * d0 - 4.0 * d1 - 0.5 * (3.0 * s0 - s1);
+    c[4] = -15.0 * dy + 8.0 * d0 + 7.0 * d1 + 0.5 * (3.0 * s0 - 2.0 * s1);
+    c[5] = 6.0 * dy - 3.0 * (d0 + d1) - 0.5 * (s0 - s1);
+  }
+}
+
+// max absolute errors of the value and derivative against the analytic
+// function built with the same parameters, sampled between the knots
+void RadialTable::error(double Rc, double eta, double Rs, double &err,
+                        double &derr) const {
+  int i, k;
+  double R, g, dg, y[3];
+  const int nsample = 8;
+
+  err = derr = 0.0;
+  for (i = 0; i < n; i++)
+    for (k = 1; k < nsample; k++) {
+      R = (i + (double)k / nsample) / scale;
+      eval(R, g, dg);
+      radial_exact(fctype, Rc, eta, Rs, R, y);
+      err = max(err, fabs(g - y[0]));
+      derr = max(derr, fabs(dg - y[1]));
+    }
+}
+
+Workspace::Workspace() {
+  nfeature = 0;
+  ncutoff = 0;
+  nneigh = 0;
+  nbatch = 0;
+  derivative = 0;
+  ntriplet = 0;
+  maxtriplet = 0;
+  for (int k = 0; k < NTIME; k++) time[k] = 0.0;
+  for (int k = 0; k < NCOUNT; k++) count[k] = 0.0;
+  tlap = peak = 0.0;
+  nfresh = 0;
+  nvisit = nreuse = ncheck = ferr = 0.0;
+  pairterms = 0;
+  pterm_angular = 0;
+}
+
+Workspace::~Workspace() {}
+
+// dG/dr_ij of each batch slot only if derivative is 1,
+// the adjoint mode contracts them with dE/dG on the fly instead
+void Workspace::reserve(int nfeature_, int ncutoff_, int jnum, int nbatch_,
+                        int derivative_) {
+  int k, ib, ndG;
+
+  if (nfeature_ == nfeature && ncutoff_ == ncutoff && jnum <= nneigh &&
+      nbatch_ <= nbatch && derivative_ == derivative)
+    return;
+
+  // some headroom so that slowly increasing jnum does not reallocate each step
+  nfeature = nfeature_;
+  ncutoff = ncutoff_;
+  if (jnum > nneigh) nneigh = jnum + jnum / 4;
+  nbatch = max(nbatch, nbatch_);
+  derivative = derivative_;
+  ndG = derivative ? nbatch : 0;
+
+  R.resize(nneigh);
+  rinv.resize(nneigh);
+  fc.resize(nneigh, ncutoff);
+  dfc.resize(nneigh, ncutoff);
+  for (k = 0; k < 3; k++) {
+    dR[k].resize(nneigh);
+    F[k].resize(nneigh);
+  }
+  iG2s.resize(nneigh);
+  neigh3.resize(nneigh);
+  pterm.resize(nneigh);
+  G.resize(nfeature);
+
+  r.resize(3 * nbatch);
+  dG_dx.resize(ndG);
+  dG_dy.resize(ndG);
+  dG_dz.resize(ndG);
+  for (ib = 0; ib < nbatch; ib++)
+    for (k = 0; k < 3; k++) r[3 * ib + k].resize(nneigh);
+  for (ib = 0; ib < ndG; ib++) {
+    dG_dx[ib].resize(nfeature, nneigh);
+    dG_dy[ib].resize(nfeature, nneigh);
+    dG_dz[ib].resize(nfeature, nneigh);
+  }
+}
+
+void Workspace::reserve_triplet(int n) {
+  int k;
+
+  if (n <= maxtriplet) return;
+
+  maxtriplet = n + n / 4;
+  tj.resize(maxtriplet);
+  tk.resize(maxtriplet);
+  iG3s.resize(maxtriplet);
+  cos.resize(maxtriplet);
+  for (k = 0; k < 3; k++) {
+    dcos_j[k].resize(maxtriplet);
+    dcos_k[k].resize(maxtriplet);
+  }
+}
+
+// allocated bytes of all buffers
+double Workspace::memory_usage() {
+  int k, l;
+  double bytes = 0.0;
+
+  bytes += (R.size() + rinv.size() + cos.size() + tpow.size()) *
+           sizeof(double);
+  bytes += (fc.size() + dfc.size() + G.size()) * sizeof(double);
+  for (k = 0; k < 3; k++)
+    bytes += (dR[k].size() + F[k].size() + dcos_j[k].size() +
+              dcos_k[k].size()) * sizeof(double);
+  for (k = 0; k < 2; k++)
+    bytes += (rad4[k].size() + tang[k].size()) * sizeof(double);
+  bytes += (mono.size() + mom.size() + madj.size() + mdiagw.size()) *
+           sizeof(double);
+  for (k = 0; k < 3; k++) bytes += trad[k].size() * sizeof(double);
+  bytes += (iG2s.capacity() + neigh3.capacity() + tj.capacity() +
+            tk.capacity() + iG3s.capacity()) * sizeof(int);
+  bytes += pterm.capacity() * sizeof(double *);
+  for (k = 0; k < (int)r.size(); k++) bytes += r[k].size() * sizeof(double);
+  for (k = 0; k < (int)dG_dx.size(); k++)
+    bytes += (dG_dx[k].size() + dG_dy[k].size() + dG_dz[k].size()) *
+             sizeof(double);
+  bytes += (Gs.size() + dE_dGs.size() + evdwls.size()) * sizeof(double);
+  bytes += (Gsf.size() + dE_dGsf.size() + evdwlsf.size()) * sizeof(float);
+  for (l = 0; l < (int)nn_out.size(); l++)
+    bytes += (nn_out[l].size() + nn_deriv[l].size()) * sizeof(double);
+  for (l = 0; l < (int)nn_outf.size(); l++)
+    bytes += (nn_outf[l].size() + nn_derivf[l].size()) * sizeof(float);
+  for (l = 0; l < (int)ilists.size(); l++)
+    bytes += ilists[l].capacity() * sizeof(int);
+  return bytes;
+}
+
+// R, 1/R and unit vectors of J neighbors from r_ij
+NNP_TARGET_CLONES
+void distance(int numneigh, VectorXd *r, Workspace &ws) {
+  int j;
+  const double *rx = r[0].data();
+  const double *ry = r[1].data();
+  const double *rz = r[2].data();
+  double *R = ws.R.data();
+  double *rinv = ws.rinv.data();
+  double *dRx = ws.dR[0].data();
+  double *dRy = ws.dR[1].data();
+  double *dRz = ws.dR[2].data();
+
+#pragma omp simd
+  for (j = 0; j < numneigh; j++) {
+    R[j] = sqrt(rx[j] * rx[j] + ry[j] * ry[j] + rz[j] * rz[j]);
+    rinv[j] = 1.0 / R[j];
+    dRx[j] = rx[j] * rinv[j];
+    dRy[j] = ry[j] * rinv[j];
+    dRz[j] = rz[j] * rinv[j];
+  }
+}
+
+// J-K pairs of J neighbors within Rc, J < K
+// cos = dR_j . dR_k
+// dcos_j = d cos / d r_ij = (dR_k - cos * dR_j) / R_j
+NNP_TARGET_CLONES
+void triplet(double Rc, int numneigh, Workspace &ws) {
+  int j, jj, kk, n3, t;
+  double dRxj, dRyj, dRzj, rinvj;
+  const double *R = ws.R.data();
+
+  n3 = 0;
+  for (j = 0; j < numneigh; j++)
+    if (R[j] <= Rc) ws.neigh3[n3++] = j;
+  ws.reserve_triplet(n3 * (n3 - 1) / 2);
+
+  const int *neigh3 = &ws.neigh3[0];
+  const double *rinv = ws.rinv.data();
+  const double *dRx = ws.dR[0].data();
+  const double *dRy = ws.dR[1].data();
+  const double *dRz = ws.dR[2].data();
+  int *tj = &ws.tj[0];
+  int *tk = &ws.tk[0];
+  double *cos = ws.cos.data();
+  double *dcosx_j = ws.dcos_j[0].data();
+  double *dcosy_j = ws.dcos_j[1].data();
+  double *dcosz_j = ws.dcos_j[2].data();
+  double *dcosx_k = ws.dcos_k[0].data();
+  double *dcosy_k = ws.dcos_k[1].data();
+  double *dcosz_k = ws.dcos_k[2].data();
+
+  t = 0;
+  for (jj = 0; jj < n3; jj++) {
+    j = neigh3[jj];
+    dRxj = dRx[j];
+    dRyj = dRy[j];
+    dRzj = dRz[j];
+    rinvj = rinv[j];
+#pragma omp simd
+    for (kk = jj + 1; kk < n3; kk++) {
+      int k = neigh3[kk];
+      int tt = t + kk - jj - 1;
+      double c = dRxj * dRx[k] + dRyj * dRy[k] + dRzj * dRz[k];
+      tj[tt] = j;
+      tk[tt] = k;
+      cos[tt] = c;
+      dcosx_j[tt] = (dRx[k] - c * dRxj) * rinvj;
+      dcosy_j[tt] = (dRy[k] - c * dRyj) * rinvj;
+      dcosz_j[tt] = (dRz[k] - c * dRzj) * rinvj;
+      dcosx_k[tt] = (dRxj - c * dRx[k]) * rinv[k];
+      dcosy_k[tt] = (dRyj - c * dRy[k]) * rinv[k];
+      dcosz_k[tt] = (dRzj - c * dRz[k]) * rinv[k];
+    }
+    t += n3 - jj - 1;
+  }
+  ws.ntriplet = t;
+}
+
+// fc and dfc of n distances R for cutoff function of type TYPE
+template <int TYPE>
+static inline void cutoff_loop(int n, const double *R, double Rc, double *fc,
+                               double *dfc) {
+#pragma omp simd
+  for (int j = 0; j < n; j++) {
+    double y[3];
+    cutoff_function(TYPE, R[j], Rc, y);
+    fc[j] = y[0];
+    dfc[j] = y[1];
+  }
+}
+
+// cutoff function fc and dfc = d fc / dR
+// of each J neighbor and each distinct Rc, 0 beyond Rc
+NNP_TARGET_CLONES
+void cutoff(const RadialParams &params, int numneigh, Workspace &ws) {
+  int c;
+  double Rc;
+  const double *R = ws.R.data();
+
+  for (c = 0; c < (int)params.Rc.size(); c++) {
+    Rc = params.Rc[c];
+    double *fc = &ws.fc.coeffRef(0, c);
+    double *dfc = &ws.dfc.coeffRef(0, c);
+    switch (params.fctype) {
+      case CUTOFF_COS:
+        cutoff_loop<CUTOFF_COS>(numneigh, R, Rc, fc, dfc);
+        break;
+      case CUTOFF_POLY1:
+        cutoff_loop<CUTOFF_POLY1>(numneigh, R, Rc, fc, dfc);
+        break;
+      case CUTOFF_POLY2:
+        cutoff_loop<CUTOFF_POLY2>(numneigh, R, Rc, fc, dfc);
+        break;
+      case CUTOFF_POLY3:
+        cutoff_loop<CUTOFF_POLY3>(numneigh, R, Rc, fc, dfc);
+        break;
+      case CUTOFF_POLY4:
+        cutoff_loop<CUTOFF_POLY4>(numneigh, R, Rc, fc, dfc);
+        break;
+      default:
+        cutoff_loop<CUTOFF_TANH3>(numneigh, R, Rc, fc, dfc);
+    }
+  }
+}
+
+// all G1 and G2 in one pass over J neighbors
+// G1 = fc, G2 = exp(-eta * (R - Rs)^2) * fc, G1 has eta = 0
+// each parameter set writes its own feature row, so the inner loop over
+// parameter sets has no conflicts
+// with tables, ws.fc is not used and no exp nor cutoff function is called
+NNP_TARGET_CLONES
+void radial(const RadialParams &params, int numneigh, Workspace &ws,
+            VectorXd &G, MatrixXd &dG_dx, MatrixXd &dG_dy, MatrixXd &dG_dz) {
+  int j, p, iG2;
+  double R, dRx, dRy, dRz, g, dg;
+  int nparams = params.iparam.size();
+  int ldfc = ws.fc.rows();
+  const int *iRc = &params.iRc[0];
+  const int *iparam = &params.iparam[0];
+  const double *eta = &params.eta[0];
+  const double *Rs = &params.Rs[0];
+  const double *fc = ws.fc.data();
+  const double *dfc = ws.dfc.data();
+  double *Gp = G.data();
+
+  if (ws.pairterms) {
+    for (j = 0; j < numneigh; j++) {
+      const double *term = ws.pterm[j];
+      dRx = ws.dR[0].coeffRef(j);
+      dRy = ws.dR[1].coeffRef(j);
+      dRz = ws.dR[2].coeffRef(j);
+      iG2 = ws.iG2s[j];
+      double *dGx = &dG_dx.coeffRef(0, j);
+      double *dGy = &dG_dy.coeffRef(0, j);
+      double *dGz = &dG_dz.coeffRef(0, j);
+#pragma omp simd
+      for (p = 0; p < nparams; p++) {
+        int iG = iparam[p] + iG2;
+        double dg = term[nparams + p];
+        Gp[iG] += term[p];
+        dGx[iG] += dg * dRx;
+        dGy[iG] += dg * dRy;
+        dGz[iG] += dg * dRz;
+      }
+    }
+    return;
+  }
+
+  if (!params.tables.empty()) {
+    for (j = 0; j < numneigh; j++) {
+      R = ws.R.coeffRef(j);
+      dRx = ws.dR[0].coeffRef(j);
+      dRy = ws.dR[1].coeffRef(j);
+      dRz = ws.dR[2].coeffRef(j);
+      iG2 = ws.iG2s[j];
+      double *dGx = &dG_dx.coeffRef(0, j);
+      double *dGy = &dG_dy.coeffRef(0, j);
+      double *dGz = &dG_dz.coeffRef(0, j);
+      for (p = 0; p < nparams; p++) {
+        int iG = iparam[p] + iG2;
+        params.tables[p].eval(R, g, dg);
+        Gp[iG] += g;
+        dGx[iG] += dg * dRx;
+        dGy[iG] += dg * dRy;
+        dGz[iG] += dg * dRz;
+      }
+    }
+    return;
+  }
+
+  for (j = 0; j < numneigh; j++) {
+    R = ws.R.coeffRef(j);
+    dRx = ws.dR[0].coeffRef(j);
+    dRy = ws.dR[1].coeffRef(j);
+    dRz = ws.dR[2].coeffRef(j);
+    iG2 = ws.iG2s[j];
+    double *dGx = &dG_dx.coeffRef(0, j);
+    double *dGy = &dG_dy.coeffRef(0, j);
+    double *dGz = &dG_dz.coeffRef(0, j);
+#pragma omp simd
+    for (p = 0; p < nparams; p++) {
+      int iG = iparam[p] + iG2;
+      double f = fc[iRc[p] * ldfc + j];
+      double df = dfc[iRc[p] * ldfc + j];
+      double exp = std::exp(-eta[p] * (R - Rs[p]) * (R - Rs[p]));
+      double coeff = exp * (df - 2.0 * eta[p] * (R - Rs[p]) * f);
+      Gp[iG] += exp * f;
+      dGx[iG] += coeff * dRx;
+      dGy[iG] += coeff * dRy;
+      dGz[iG] += coeff * dRz;
+    }
+  }
+}
+
+// G1 and G2 only, 1st pass of the adjoint mode
+NNP_TARGET_CLONES
+void radial_value(const RadialParams &params, int numneigh, Workspace &ws,
+                  VectorXd &G) {
+  int j, p, iG2;
+  double R, g, dg;
+  int nparams = params.iparam.size();
+  int ldfc = ws.fc.rows();
+  const int *iRc = &params.iRc[0];
+  const int *iparam = &params.iparam[0];
+  const double *eta = &params.eta[0];
+  const double *Rs = &params.Rs[0];
+  const double *fc = ws.fc.data();
+  double *Gp = G.data();
+
+  if (ws.pairterms) {
+    for (j = 0; j < numneigh; j++) {
+      const double *term = ws.pterm[j];
+      iG2 = ws.iG2s[j];
+#pragma omp simd
+      for (p = 0; p < nparams; p++) Gp[iparam[p] + iG2] += term[p];
+    }
+    return;
+  }
+
+  if (!params.tables.empty()) {
+    for (j = 0; j < numneigh; j++) {
+      R = ws.R.coeffRef(j);
+      iG2 = ws.iG2s[j];
+      for (p = 0; p < nparams; p++) {
+        params.tables[p].eval(R, g, dg);
+        Gp[iparam[p] + iG2] += g;
+      }
+    }
+    return;
+  }
+
+  for (j = 0; j < numneigh; j++) {
+    R = ws.R.coeffRef(j);
+    iG2 = ws.iG2s[j];
+#pragma omp simd
+    for (p = 0; p < nparams; p++) {
+      double f = fc[iRc[p] * ldfc + j];
+      Gp[iparam[p] + iG2] += std::exp(-eta[p] * (R - Rs[p]) * (R - Rs[p])) * f;
+    }
+  }
+}
+
+// forces of G1 and G2 on J neighbors, -dE/dG . dG/dr_ij, added to ws.F
+// dG/dr_ij of all parameter sets are parallel to r_ij,
+// so they are reduced to one scalar per J neighbor
+NNP_TARGET_CLONES
+void radial_force(const RadialParams &params, int numneigh, Workspace &ws,
+                  const double *dE_dG) {
+  int j, p, iG2;
+  double R, dE_dR, g, dg;
+  int nparams = params.iparam.size();
+  int ldfc = ws.fc.rows();
+  const int *iRc = &params.iRc[0];
+  const int *iparam = &params.iparam[0];
+  const double *eta = &params.eta[0];
+  const double *Rs = &params.Rs[0];
+  const double *fc = ws.fc.data();
+  const double *dfc = ws.dfc.data();
+  int tabulated = !params.tables.empty();
+
+  for (j = 0; j < numneigh; j++) {
+    R = ws.R.coeffRef(j);
+    iG2 = ws.iG2s[j];
+    dE_dR = 0.0;
+    if (ws.pairterms) {
+      const double *dterm = ws.pterm[j] + nparams;
+#pragma omp simd reduction(+ : dE_dR)
+      for (p = 0; p < nparams; p++) dE_dR += dE_dG[iparam[p] + iG2] * dterm[p];
+    } else if (tabulated) {
+      for (p = 0; p < nparams; p++) {
+        params.tables[p].eval(R, g, dg);
+        dE_dR += dE_dG[iparam[p] + iG2] * dg;
+      }
+    } else {
+#pragma omp simd reduction(+ : dE_dR)
+      for (p = 0; p < nparams; p++) {
+        double f = fc[iRc[p] * ldfc + j];
+        double df = dfc[iRc[p] * ldfc + j];
+        double exp = std::exp(-eta[p] * (R - Rs[p]) * (R - Rs[p]));
+        dE_dR += dE_dG[iparam[p] + iG2] *
+                 exp * (df - 2.0 * eta[p] * (R - Rs[p]) * f);
+      }
+    }
+    ws.F[0].coeffRef(j) -= dE_dR * ws.dR[0].coeffRef(j);
+    ws.F[1].coeffRef(j) -= dE_dR * ws.dR[1].coeffRef(j);
+    ws.F[2].coeffRef(j) -= dE_dR * ws.dR[2].coeffRef(j);
+  }
+}
+
+int radial_terms_size(const RadialParams &radial,
+                      const AngularParams &angular) {
+  return 2 * (radial.iparam.size() + angular.eta.size());
+}
+
+// terms of a pair at distance R into term, from tables if any
+// they depend only on R, so I-J and J-I share them
+NNP_TARGET_CLONES
+void radial_terms(const RadialParams &radial, const AngularParams &angular,
+                  double R, double *term) {
+  int c, p, r;
+  int nparams = radial.iparam.size();
+  int nrad = angular.eta.size();
+  int ncutoff = radial.Rc.size();
+  double fc[NNP_MAX_CUTOFF], dfc[NNP_MAX_CUTOFF];
+  double *g = term;
+  double *dg = term + nparams;
+  double *rad0 = term + 2 * nparams;
+  double *rad1 = rad0 + nrad;
+
+  if (!radial.tables.empty()) {
+    for (p = 0; p < nparams; p++) radial.tables[p].eval(R, g[p], dg[p]);
+    for (r = 0; r < nrad; r++) angular.tables[r].eval(R, rad0[r], rad1[r]);
+    return;
+  }
+
+  for (c = 0; c < ncutoff; c++) {
+    double y[3];
+    cutoff_function(radial.fctype, R, radial.Rc[c], y);
+    fc[c] = y[0];
+    dfc[c] = y[1];
+  }
+
+#pragma omp simd
+  for (p = 0; p < nparams; p++) {
+    double eta = radial.eta[p];
+    double Rs = radial.Rs[p];
+    double f = fc[radial.iRc[p]];
+    double df = dfc[radial.iRc[p]];
+    double exp = std::exp(-eta * (R - Rs) * (R - Rs));
+    g[p] = exp * f;
+    dg[p] = exp * (df - 2.0 * eta * (R - Rs) * f);
+  }
+  for (r = 0; r < nrad; r++) {
+    double eta = angular.eta[r];
+    double f = fc[angular.iRc[r]];
+    double df = dfc[angular.iRc[r]];
+    double exp = std::exp(-eta * R * R);
+    rad0[r] = exp * f;
+    rad1[r] = exp * (df - 2.0 * eta * R * f);
+  }
+}
+
+// radial parts of distinct (eta, Rc) of J neighbors and their products for
+// J-K pairs, and angular parts of distinct (lambda, zeta) for J-K pairs,
+// shared by angular, angular_value and angular_force
+// integer zeta is raised by repeated squaring instead of pow
+NNP_TARGET_CLONES
+static void angular_factors(const AngularParams &params, int numneigh,
+                            Workspace &ws) {
+  int r, a, j, t, e;
+  int nrad = params.eta.size();
+  int nang = params.lambda.size();
+  int ntriplet = ws.ntriplet;
+  const double *R = ws.R.data();
+  const int *tj = &ws.tj[0];
+  const int *tk = &ws.tk[0];
+  const double *cos = ws.cos.data();
+
+  if (ws.rad4[0].rows() < numneigh || ws.rad4[0].cols() != nrad) {
+    ws.rad4[0].resize(ws.nneigh, nrad);
+    ws.rad4[1].resize(ws.nneigh, nrad);
+  }
+  if (ws.trad[0].rows() < ntriplet || ws.trad[0].cols() != nrad ||
+      ws.tang[0].cols() != nang) {
+    for (t = 0; t < 3; t++) ws.trad[t].resize(ws.maxtriplet, nrad);
+    ws.tang[0].resize(ws.maxtriplet, nang);
+    ws.tang[1].resize(ws.maxtriplet, nang);
+    ws.tpow.resize(ws.maxtriplet);
+  }
+
+  for (r = 0; r < nrad; r++) {
+    double eta = params.eta[r];
+    const double *fc = &ws.fc.coeffRef(0, params.iRc[r]);
+    const double *dfc = &ws.dfc.coeffRef(0, params.iRc[r]);
+    double *rad0 = &ws.rad4[0].coeffRef(0, r);
+    double *rad1 = &ws.rad4[1].coeffRef(0, r);
+    double *prod = &ws.trad[0].coeffRef(0, r);
+    double *prodj = &ws.trad[1].coeffRef(0, r);
+    double *prodk = &ws.trad[2].coeffRef(0, r);
+
+    if (ws.pairterms) {
+      for (j = 0; j < numneigh; j++) {
+        rad0[j] = ws.pterm[j][ws.pterm_angular + r];
+        rad1[j] = ws.pterm[j][ws.pterm_angular + nrad + r];
+      }
+    } else if (!params.tables.empty()) {
+      for (j = 0; j < numneigh; j++)
+        params.tables[r].eval(R[j], rad0[j], rad1[j]);
+    } else {
+#pragma omp simd
+      for (j = 0; j < numneigh; j++) {
+        double exp = std::exp(-eta * R[j] * R[j]);
+        rad0[j] = exp * fc[j];
+        rad1[j] = exp * (dfc[j] - 2.0 * eta * R[j] * fc[j]);
+      }
+    }
+
+#pragma omp simd
+    for (t = 0; t < ntriplet; t++) {
+      prod[t] = rad0[tj[t]] * rad0[tk[t]];
+      prodj[t] = rad1[tj[t]] * rad0[tk[t]];
+      prodk[t] = rad1[tk[t]] * rad0[tj[t]];
+    }
+  }
+
+  // angz1 = 2^(1-zeta) * ang^(zeta-1), ang = 1 + lambda * cos
+  // angz = angz1 * ang and dangz = zeta * lambda * angz1
+  for (a = 0; a < nang; a++) {
+    double lambda = params.lambda[a];
+    double zeta = params.zeta[a];
+    double coeffs = pow(2.0, 1 - zeta);
+    double *angz = &ws.tang[0].coeffRef(0, a);
+    double *dangz = &ws.tang[1].coeffRef(0, a);
+    double *base = ws.tpow.data();
+
+    if (params.izeta[a] > 0) {
+#pragma omp simd
+      for (t = 0; t < ntriplet; t++) {
+        dangz[t] = 1.0;
+        base[t] = 1.0 + lambda * cos[t];
+      }
+      for (e = params.izeta[a] - 1; e > 0; e >>= 1) {
+        if (e & 1) {
+#pragma omp simd
+          for (t = 0; t < ntriplet; t++) dangz[t] *= base[t];
+        }
+        if (e > 1) {
+#pragma omp simd
+          for (t = 0; t < ntriplet; t++) base[t] *= base[t];
+        }
+      }
+#pragma omp simd
+      for (t = 0; t < ntriplet; t++) {
+        double angz1 = coeffs * dangz[t];
+        angz[t] = angz1 * (1.0 + lambda * cos[t]);
+        dangz[t] = zeta * lambda * angz1;
+      }
+    } else {
+#pragma omp simd
+      for (t = 0; t < ntriplet; t++) {
+        double ang = 1.0 + lambda * cos[t];
+        double angz1 = coeffs * pow(ang, zeta - 1);
+        angz[t] = angz1 * ang;
+        dangz[t] = zeta * lambda * angz1;
+      }
+    }
+  }
+}
+
+// monomials u_j^a of J neighbors within Rcmoment, and moments
+// sum_j rad_j u_j^a of J of each element for each radial part, after
+// angular_factors. the last row of moments is sum_j rad_j^2
+NNP_TARGET_CLONES
+static void moments(const AngularParams &params, int numneigh, Workspace &ws) {
+  int j, m, r;
+  int nrad = params.eta.size();
+  int nelement = params.nelement;
+  int nmono = params.nmono;
+  const int *mprev = &params.mprev[0];
+  const int *maxis = &params.maxis[0];
+  const double *R = ws.R.data();
+
+  if (ws.mono.rows() != nmono || ws.mono.cols() < numneigh)
+    ws.mono.resize(nmono, ws.nneigh);
+  ws.mom.setZero(nmono + 1, nrad * nelement);
 
   for (j = 0; j < numneigh; j++) {
-    if (R.coeffRef(j) > Rc) continue;
-    iG = iparam + iG2s[j];
-    G.coeffRef(iG) += g.coeffRef(j);
-    dG_dx.coeffRef(iG, j) += dg[0].coeffRef(j);
-    dG_dy.coeffRef(iG, j) += dg[1].coeffRef(j);
-    dG_dz.coeffRef(iG, j) += dg[2].coeffRef(j);
-  }
-}
-
-void G2(vector<double> params, int iparam, vector<int> iG2s, int numneigh,
-        VectorXd &R, VectorXd *dR, VectorXd &G, MatrixXd &dG_dx, MatrixXd &dG_dy, MatrixXd &dG_dz) {
-  int j, iG;
-  VectorXd tanh, coeff, g, dg[3];
-  double Rc = params[0];
-  double eta = params[1];
-  double Rs = params[2];
-  tanh = (1.0 - R.array() / Rc).tanh();
-  g = (-eta * (R.array() - Rs).square()).exp() * tanh.array().cube();
-  coeff = (-eta * (R.array() - Rs).square()).exp() * tanh.array().square() *
-          (-2.0 * eta * (R.array() - Rs) * tanh.array() +
-           3.0 / Rc * (tanh.array().square() - 1.0));
-  dg[0] = coeff.array() * dR[0].array();
-  dg[1] = coeff.array() * dR[1].array();
-  dg[2] = coeff.array() * dR[2].array();
+    if (R[j] > params.Rcmoment) continue;
+    double u[3] = {ws.dR[0].coeffRef(j), ws.dR[1].coeffRef(j),
+                   ws.dR[2].coeffRef(j)};
+    double *p = &ws.mono.coeffRef(0, j);
+    p[0] = 1.0;
+    for (m = 1; m < nmono; m++) p[m] = p[mprev[m]] * u[maxis[m]];
+
+    for (r = 0; r < nrad; r++) {
+      double rad = ws.rad4[0].coeffRef(j, r);
+      if (rad == 0.0) continue;
+      double *M = &ws.mom.coeffRef(0, r * nelement + ws.iG2s[j]);
+#pragma omp simd
+      for (m = 0; m < nmono; m++) M[m] += rad * p[m];
+      M[nmono] += rad * rad;
+    }
+  }
+}
+
+// G4 of expanded parts from moments. the sum over J-K pairs of elements
+// e1 != e2 is sum_a coeff_n(a) mult_a M1_a M2_a, and that of e1 = e2 is half
+// of the same sum over J = K minus its J = K terms
+static void moment_value(const AngularParams &params, Workspace &ws,
+                         VectorXd &G) {
+  int s, a, r, m, e1, e2, nm, iG;
+  int nset = params.iparam.size();
+  int nelement = params.nelement;
+  int nmono = params.nmono;
+  const int *mdegree = &params.mdegree[0];
+  const double *mmult = &params.mmult[0];
+
+  for (s = 0; s < nset; s++) {
+    a = params.iang[s];
+    if (!params.moment[a]) continue;
+    r = params.irad[s];
+    nm = (params.izeta[a] + 1) * (params.izeta[a] + 2) *
+         (params.izeta[a] + 3) / 6;
+    const double *coeff = &params.mcoeff.coeffRef(0, a);
+
+    for (e1 = 0; e1 < nelement; e1++)
+      for (e2 = e1; e2 < nelement; e2++) {
+        const double *M1 = &ws.mom.coeffRef(0, r * nelement + e1);
+        const double *M2 = &ws.mom.coeffRef(0, r * nelement + e2);
+        double g = 0.0;
+        for (m = 0; m < nm; m++)
+          g += coeff[mdegree[m]] * mmult[m] * M1[m] * M2[m];
+        if (e1 == e2) g = 0.5 * (g - params.mdiag[a] * M1[nmono]);
+        iG = params.iparam[s] + params.combination[e1 * nelement + e2];
+        G.coeffRef(iG) += g;
+      }
+  }
+}
+
+// sums over monomials of degree n of w_a p_a, n w_a p_a and
+// w_a d p_a / d u of monomials p of a J neighbor, for n up to maxdegree.
+// with a radial part rad and its derivative drad, the derivative of
+// sum_a w_a rad u^a w.r.t. r_ij is
+// drad * T u + rad / R * (Tu - N u), T = sum_n T[0][n], N = sum_n n T[0][n]
+// and Tu = sum_n T[1..3][n]
+static inline void moment_degree(const AngularParams &params, const double *w,
+                                 const double *p,
+                                 double T[4][NNP_MOMENT_MAX_ZETA + 1]) {
+  int m, n, d;
+  int nmono = params.nmono;
+  const int *mdegree = &params.mdegree[0];
+  const int *mdownx = &params.mdown[0][0];
+  const int *mdowny = &params.mdown[1][0];
+  const int *mdownz = &params.mdown[2][0];
+  const double *mexpx = &params.mexp[0][0];
+  const double *mexpy = &params.mexp[1][0];
+  const double *mexpz = &params.mexp[2][0];
+
+  for (d = 0; d < 4; d++)
+    for (n = 0; n <= params.maxdegree; n++) T[d][n] = 0.0;
+  for (m = 0; m < nmono; m++) {
+    n = mdegree[m];
+    T[0][n] += w[m] * p[m];
+    T[1][n] += w[m] * mexpx[m] * p[mdownx[m]];
+    T[2][n] += w[m] * mexpy[m] * p[mdowny[m]];
+    T[3][n] += w[m] * mexpz[m] * p[mdownz[m]];
+  }
+}
+
+// derivatives of G4 of expanded parts w.r.t. r_ij, after moment_value.
+// G of elements e and b has d/dr_ij = sum_a coeff_n mult_a M_b,a d(rad_j u^a)
+// of J of element e, minus the derivative of the J = K term for e = b
+NNP_TARGET_CLONES
+static void moment_derivative(const AngularParams &params, int numneigh,
+                              Workspace &ws, MatrixXd &dG_dx,
+                              MatrixXd &dG_dy, MatrixXd &dG_dz) {
+  int j, s, a, r, m, n, e, b, iG;
+  int nset = params.iparam.size();
+  int nrad = params.eta.size();
+  int nelement = params.nelement;
+  int nmono = params.nmono;
+  double T[4][NNP_MOMENT_MAX_ZETA + 1];
+  const double *R = ws.R.data();
+
+  // mult_a M_a of each radial part and element, madj is not used out of
+  // the adjoint mode
+  ws.madj.resize(nmono, nrad * nelement);
+  for (b = 0; b < nrad * nelement; b++)
+    for (m = 0; m < nmono; m++)
+      ws.madj.coeffRef(m, b) = params.mmult[m] * ws.mom.coeffRef(m, b);
 
   for (j = 0; j < numneigh; j++) {
-    if (R.coeffRef(j) > Rc) continue;
-    iG = iparam + iG2s[j];
-    G.coeffRef(iG) += g.coeffRef(j);
-    dG_dx.coeffRef(iG, j) += dg[0].coeffRef(j);
-    dG_dy.coeffRef(iG, j) += dg[1].coeffRef(j);
-    dG_dz.coeffRef(iG, j) += dg[2].coeffRef(j);
-  }
-}
-
-void G4(vector<double> params, int iparam, vector<vector<int> > iG3s, int numneigh,
-        VectorXd &R, MatrixXd &cos, VectorXd *dR, MatrixXd *dcos,
-        VectorXd &G, MatrixXd &dG_dx, MatrixXd &dG_dy, MatrixXd &dG_dz) {
-  int j, k, iG;
-  double coeffs;
-  VectorXd tanh, rad1, rad2;
-  MatrixXd ang, g, coeff1, coeff2, dg[3];
-  double Rc = params[0];
-  double eta = params[1];
-  double lambda = params[2];
-  double zeta = params[3];
-
-  tanh = (1.0 - R.array() / Rc).tanh();
-  coeffs = pow(2.0, 1 - zeta);
-  ang = 1.0 + lambda * cos.array();
-  rad1 = (-eta * R.array().square()).exp() * tanh.array().cube();
-  rad2 = (-eta * R.array().square()).exp() * tanh.array().square() *
-         (-2.0 * eta * R.array() * tanh.array() +
-          3.0 / Rc * (tanh.array().square() - 1.0));
-  g = ((0.5 * coeffs * ang.array().pow(zeta)).colwise() * rad1.array())
-          .rowwise() *
-      rad1.transpose().array();
-  coeff1 =
-      ((coeffs * ang.array().pow(zeta)).colwise() * rad2.array()).rowwise() *
-      rad1.transpose().array();
-  coeff2 = ((zeta * lambda * coeffs * ang.array().pow(zeta - 1)).colwise() *
-            rad1.array())
-               .rowwise() *
-           rad1.transpose().array();
-  dg[0] = coeff1.array().colwise() * dR[0].array() +
-          coeff2.array() * dcos[0].array();
-  dg[1] = coeff1.array().colwise() * dR[1].array() +
-          coeff2.array() * dcos[1].array();
-  dg[2] = coeff1.array().colwise() * dR[2].array() +
-          coeff2.array() * dcos[2].array();
+    if (R[j] > params.Rcmoment) continue;
+    double u[3] = {ws.dR[0].coeffRef(j), ws.dR[1].coeffRef(j),
+                   ws.dR[2].coeffRef(j)};
+    double rinv = ws.rinv.coeffRef(j);
+    const double *p = &ws.mono.coeffRef(0, j);
+    e = ws.iG2s[j];
+
+    for (r = 0; r < nrad; r++) {
+      double rad = ws.rad4[0].coeffRef(j, r);
+      double drad = ws.rad4[1].coeffRef(j, r);
+      if (rad == 0.0 && drad == 0.0) continue;
+
+      for (b = 0; b < nelement; b++) {
+        moment_degree(params, &ws.madj.coeffRef(0, r * nelement + b), p, T);
+
+        for (s = 0; s < nset; s++) {
+          a = params.iang[s];
+          if (!params.moment[a] || params.irad[s] != r) continue;
+          const double *coeff = &params.mcoeff.coeffRef(0, a);
+          double A = 0.0, N = 0.0, Tu[3] = {0.0, 0.0, 0.0}, dG[3];
+          for (n = 0; n <= params.izeta[a]; n++) {
+            A += coeff[n] * T[0][n];
+            N += coeff[n] * n * T[0][n];
+            Tu[0] += coeff[n] * T[1][n];
+            Tu[1] += coeff[n] * T[2][n];
+            Tu[2] += coeff[n] * T[3][n];
+          }
+          double du = drad * A - rad * rinv * N;
+          if (b == e) du -= params.mdiag[a] * rad * drad;
+          for (n = 0; n < 3; n++) dG[n] = du * u[n] + rad * rinv * Tu[n];
+          iG = params.iparam[s] + params.combination[e * nelement + b];
+          dG_dx.coeffRef(iG, j) += dG[0];
+          dG_dy.coeffRef(iG, j) += dG[1];
+          dG_dz.coeffRef(iG, j) += dG[2];
+        }
+      }
+    }
+  }
+}
+
+// forces of G4 of expanded parts on J neighbors, added to ws.F.
+// dE/dG of all sets and elements are first summed into dE/d moments of each
+// radial part and element, so each J is one pass over monomials
+NNP_TARGET_CLONES
+static void moment_force(const AngularParams &params, int numneigh,
+                         Workspace &ws, const double *dE_dG) {
+  int j, s, a, r, m, n, e, b, nm, col;
+  int nset = params.iparam.size();
+  int nrad = params.eta.size();
+  int nelement = params.nelement;
+  int nmono = params.nmono;
+  double T[4][NNP_MOMENT_MAX_ZETA + 1];
+  const int *mdegree = &params.mdegree[0];
+  const double *mmult = &params.mmult[0];
+  const double *R = ws.R.data();
+
+  ws.madj.setZero(nmono, nrad * nelement);
+  ws.mdiagw.setZero(nrad * nelement);
+  for (s = 0; s < nset; s++) {
+    a = params.iang[s];
+    if (!params.moment[a]) continue;
+    r = params.irad[s];
+    nm = (params.izeta[a] + 1) * (params.izeta[a] + 2) *
+         (params.izeta[a] + 3) / 6;
+    const double *coeff = &params.mcoeff.coeffRef(0, a);
+    for (e = 0; e < nelement; e++)
+      for (b = 0; b < nelement; b++) {
+        double dE = dE_dG[params.iparam[s] +
+                          params.combination[e * nelement + b]];
+        if (dE == 0.0) continue;
+        double *Q = &ws.madj.coeffRef(0, r * nelement + e);
+        const double *Mb = &ws.mom.coeffRef(0, r * nelement + b);
+        for (m = 0; m < nm; m++)
+          Q[m] += dE * coeff[mdegree[m]] * mmult[m] * Mb[m];
+        if (b == e) ws.mdiagw[r * nelement + e] += dE * params.mdiag[a];
+      }
+  }
 
   for (j = 0; j < numneigh; j++) {
-    if (R.coeffRef(j) > Rc) continue;
-    for (k = 0; k < numneigh; k++) {
-      if (R.coeffRef(k) > Rc) continue;
-      if (j == k) continue;
-      iG = iparam + iG3s[j][k];
-      G.coeffRef(iG) += g.coeffRef(j, k);
-      dG_dx.coeffRef(iG, j) += dg[0].coeffRef(j, k);
-      dG_dy.coeffRef(iG, j) += dg[1].coeffRef(j, k);
-      dG_dz.coeffRef(iG, j) += dg[2].coeffRef(j, k);
+    if (R[j] > params.Rcmoment) continue;
+    double u[3] = {ws.dR[0].coeffRef(j), ws.dR[1].coeffRef(j),
+                   ws.dR[2].coeffRef(j)};
+    double rinv = ws.rinv.coeffRef(j);
+    const double *p = &ws.mono.coeffRef(0, j);
+    e = ws.iG2s[j];
+
+    for (r = 0; r < nrad; r++) {
+      double rad = ws.rad4[0].coeffRef(j, r);
+      double drad = ws.rad4[1].coeffRef(j, r);
+      if (rad == 0.0 && drad == 0.0) continue;
+      col = r * nelement + e;
+      moment_degree(params, &ws.madj.coeffRef(0, col), p, T);
+      double A = 0.0, N = 0.0, Tu[3] = {0.0, 0.0, 0.0};
+      for (n = 0; n <= params.maxdegree; n++) {
+        A += T[0][n];
+        N += n * T[0][n];
+        Tu[0] += T[1][n];
+        Tu[1] += T[2][n];
+        Tu[2] += T[3][n];
+      }
+      double du = drad * A - rad * rinv * N - ws.mdiagw[col] * rad * drad;
+      for (n = 0; n < 3; n++)
+        ws.F[n].coeffRef(j) -= du * u[n] + rad * rinv * Tu[n];
+    }
+  }
+}
+
+// all G4 as sums over J-K pairs in the triplet list of ws, each pair once,
+// or from moments for expanded parts
+// radial parts of J beyond Rc of a set are 0
+NNP_TARGET_CLONES
+void angular(const AngularParams &params, int numneigh, Workspace &ws,
+             VectorXd &G, MatrixXd &dG_dx, MatrixXd &dG_dy, MatrixXd &dG_dz) {
+  int s, j, k, t, iG;
+  double g, cj, ck, c2;
+  int nset = params.iparam.size();
+  int ntriplet = ws.ntriplet;
+  const int *tj = &ws.tj[0];
+  const int *tk = &ws.tk[0];
+  const int *iG3s = &ws.iG3s[0];
+  const double *dRx = ws.dR[0].data();
+  const double *dRy = ws.dR[1].data();
+  const double *dRz = ws.dR[2].data();
+  const double *dcosx_j = ws.dcos_j[0].data();
+  const double *dcosy_j = ws.dcos_j[1].data();
+  const double *dcosz_j = ws.dcos_j[2].data();
+  const double *dcosx_k = ws.dcos_k[0].data();
+  const double *dcosy_k = ws.dcos_k[1].data();
+  const double *dcosz_k = ws.dcos_k[2].data();
+
+  angular_factors(params, numneigh, ws);
+  if (params.nmoment) {
+    moments(params, numneigh, ws);
+    moment_value(params, ws, G);
+    moment_derivative(params, numneigh, ws, dG_dx, dG_dy, dG_dz);
+  }
+
+  for (s = 0; s < nset; s++) {
+    if (params.moment[params.iang[s]]) continue;
+    const double *prod = &ws.trad[0].coeffRef(0, params.irad[s]);
+    const double *prodj = &ws.trad[1].coeffRef(0, params.irad[s]);
+    const double *prodk = &ws.trad[2].coeffRef(0, params.irad[s]);
+    const double *angz = &ws.tang[0].coeffRef(0, params.iang[s]);
+    const double *dangz = &ws.tang[1].coeffRef(0, params.iang[s]);
+
+    for (t = 0; t < ntriplet; t++) {
+      if (prod[t] == 0.0 && prodj[t] == 0.0 && prodk[t] == 0.0) continue;
+      g = angz[t] * prod[t];
+      cj = angz[t] * prodj[t];
+      ck = angz[t] * prodk[t];
+      c2 = dangz[t] * prod[t];
+      j = tj[t];
+      k = tk[t];
+      iG = params.iparam[s] + iG3s[t];
+      G.coeffRef(iG) += g;
+      dG_dx.coeffRef(iG, j) += cj * dRx[j] + c2 * dcosx_j[t];
+      dG_dy.coeffRef(iG, j) += cj * dRy[j] + c2 * dcosy_j[t];
+      dG_dz.coeffRef(iG, j) += cj * dRz[j] + c2 * dcosz_j[t];
+      dG_dx.coeffRef(iG, k) += ck * dRx[k] + c2 * dcosx_k[t];
+      dG_dy.coeffRef(iG, k) += ck * dRy[k] + c2 * dcosy_k[t];
+      dG_dz.coeffRef(iG, k) += ck * dRz[k] + c2 * dcosz_k[t];
+    }
+  }
+}
+
+// G4 only, 1st pass of the adjoint mode
+NNP_TARGET_CLONES
+void angular_value(const AngularParams &params, int numneigh, Workspace &ws,
+                   VectorXd &G) {
+  int s, t;
+  int nset = params.iparam.size();
+  int ntriplet = ws.ntriplet;
+  const int *iG3s = &ws.iG3s[0];
+
+  angular_factors(params, numneigh, ws);
+  if (params.nmoment) {
+    moments(params, numneigh, ws);
+    moment_value(params, ws, G);
+  }
+
+  for (s = 0; s < nset; s++) {
+    if (params.moment[params.iang[s]]) continue;
+    const double *prod = &ws.trad[0].coeffRef(0, params.irad[s]);
+    const double *angz = &ws.tang[0].coeffRef(0, params.iang[s]);
+    double *Gp = G.data() + params.iparam[s];
+
+    for (t = 0; t < ntriplet; t++) Gp[iG3s[t]] += angz[t] * prod[t];
+  }
+}
+
+// forces of G4 on J neighbors, -dE/dG . dG/dr_ij, added to ws.F
+NNP_TARGET_CLONES
+void angular_force(const AngularParams &params, int numneigh, Workspace &ws,
+                   const double *dE_dG) {
+  int s, j, k, t;
+  double dE, cj, ck, c2;
+  int nset = params.iparam.size();
+  int ntriplet = ws.ntriplet;
+  const int *tj = &ws.tj[0];
+  const int *tk = &ws.tk[0];
+  const int *iG3s = &ws.iG3s[0];
+  const double *dRx = ws.dR[0].data();
+  const double *dRy = ws.dR[1].data();
+  const double *dRz = ws.dR[2].data();
+  const double *dcosx_j = ws.dcos_j[0].data();
+  const double *dcosy_j = ws.dcos_j[1].data();
+  const double *dcosz_j = ws.dcos_j[2].data();
+  const double *dcosx_k = ws.dcos_k[0].data();
+  const double *dcosy_k = ws.dcos_k[1].data();
+  const double *dcosz_k = ws.dcos_k[2].data();
+  double *Fx = ws.F[0].data();
+  double *Fy = ws.F[1].data();
+  double *Fz = ws.F[2].data();
+
+  angular_factors(params, numneigh, ws);
+  if (params.nmoment) {
+    moments(params, numneigh, ws);
+    moment_force(params, numneigh, ws, dE_dG);
+  }
+
+  for (s = 0; s < nset; s++) {
+    if (params.moment[params.iang[s]]) continue;
+    const double *prod = &ws.trad[0].coeffRef(0, params.irad[s]);
+    const double *prodj = &ws.trad[1].coeffRef(0, params.irad[s]);
+    const double *prodk = &ws.trad[2].coeffRef(0, params.irad[s]);
+    const double *angz = &ws.tang[0].coeffRef(0, params.iang[s]);
+    const double *dangz = &ws.tang[1].coeffRef(0, params.iang[s]);
+    const double *dE_dGs = dE_dG + params.iparam[s];
+
+    for (t = 0; t < ntriplet; t++) {
+      dE = dE_dGs[iG3s[t]];
+      cj = dE * angz[t] * prodj[t];
+      ck = dE * angz[t] * prodk[t];
+      c2 = dE * dangz[t] * prod[t];
+      if (cj == 0.0 && ck == 0.0 && c2 == 0.0) continue;
+      j = tj[t];
+      k = tk[t];
+      Fx[j] -= cj * dRx[j] + c2 * dcosx_j[t];
+      Fy[j] -= cj * dRy[j] + c2 * dcosy_j[t];
+      Fz[j] -= cj * dRz[j] + c2 * dcosz_j[t];
+      Fx[k] -= ck * dRx[k] + c2 * dcosx_k[t];
+      Fy[k] -= ck * dRy[k] + c2 * dcosy_k[t];
+      Fz[k] -= ck * dRz[k] + c2 * dcosz_k[t];
     }
   }
 }
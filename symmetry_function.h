@@ -10,6 +10,7 @@
 #define EIGEN_MPL2_ONLY
 
 #include <Eigen/Core>
+#include <cmath>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -17,13 +18,296 @@
 using namespace std;
 using namespace Eigen;
 
-void G1(vector<double>, int, vector<int>, int, VectorXd &, VectorXd *,
-        VectorXd &, MatrixXd &, MatrixXd &, MatrixXd &);
+// kernels defined with NNP_TARGET_CLONES are compiled for AVX-512, AVX2 and
+// generic x86-64, and the best one is selected at runtime by GCC.
+// their loops over neighbors and triplets are written on raw SoA arrays
+// with "omp simd", so build with -fopenmp-simd (or -fopenmp)
+#if defined(__GNUC__) && __GNUC__ >= 6 && defined(__x86_64__) && \
+    !defined(__clang__) && !defined(__INTEL_COMPILER)
+#define NNP_TARGET_CLONES                                           \
+  __attribute__((target_clones("arch=skylake-avx512", "arch=haswell", \
+                               "default")))
+#else
+#define NNP_TARGET_CLONES
+#endif
 
-void G2(vector<double>, int, vector<int>, int, VectorXd &, VectorXd *,
-        VectorXd &, MatrixXd &, MatrixXd &, MatrixXd &);
+// cutoff functions fc(R) of x = R/Rc, which are 0 at and beyond Rc
+//   tanh3 : tanh^3(1 - x)
+//   cos   : (cos(pi x) + 1) / 2
+//   polyN : polynomials of degree 2N+1 whose derivatives up to the N-th
+//           are 0 at both ends, no transcendental function is called
+//           poly1 = (2x - 3) x^2 + 1
+//           poly2 = ((15 - 6x) x - 10) x^3 + 1
+//           poly3 = (x (x (20x - 70) + 84) - 35) x^4 + 1
+//           poly4 = (x (x ((315 - 70x) x - 540) + 420) - 126) x^5 + 1
+enum { CUTOFF_TANH3, CUTOFF_COS, CUTOFF_POLY1, CUTOFF_POLY2, CUTOFF_POLY3,
+       CUTOFF_POLY4, NCUTOFF };
 
-void G4(vector<double>, int, vector<vector<int> >, int, VectorXd &, MatrixXd &,
-        VectorXd *, MatrixXd *, VectorXd &, MatrixXd &, MatrixXd &, MatrixXd &);
+// type of the name in the potential file, or -1 if unknown
+int cutoff_type(const string &);
+
+// fc and its 1st and 2nd derivatives w.r.t. R into y, those at Rc are the
+// limits from below for tables. with a constant type,
+// the switch is resolved at compile time and the unused terms are dropped
+inline void cutoff_function(int type, double R, double Rc, double *y) {
+  double x = R <= Rc ? R / Rc : 1.0;
+  double xm = x - 1.0, x2 = x * x, f, df, d2f;
+  switch (type) {
+    case CUTOFF_COS: {
+      const double pi = 3.14159265358979323846;
+      double c = std::cos(pi * x), a = pi / Rc;
+      f = 0.5 * (c + 1.0);
+      df = -0.5 * a * std::sin(pi * x);
+      d2f = -0.5 * a * a * c;
+      break;
+    }
+    case CUTOFF_POLY1:
+      f = (2.0 * x - 3.0) * x2 + 1.0;
+      df = 6.0 * x * xm / Rc;
+      d2f = (12.0 * x - 6.0) / (Rc * Rc);
+      break;
+    case CUTOFF_POLY2:
+      f = ((15.0 - 6.0 * x) * x - 10.0) * x2 * x + 1.0;
+      df = -30.0 * x2 * xm * xm / Rc;
+      d2f = -60.0 * x * xm * (2.0 * x - 1.0) / (Rc * Rc);
+      break;
+    case CUTOFF_POLY3:
+      f = (x * (x * (20.0 * x - 70.0) + 84.0) - 35.0) * x2 * x2 + 1.0;
+      df = 140.0 * x2 * x * xm * xm * xm / Rc;
+      d2f = 420.0 * x2 * xm * xm * (2.0 * x - 1.0) / (Rc * Rc);
+      break;
+    case CUTOFF_POLY4:
+      f = (x * (x * ((315.0 - 70.0 * x) * x - 540.0) + 420.0) - 126.0) *
+              x2 * x2 * x + 1.0;
+      df = -630.0 * x2 * x2 * xm * xm * xm * xm / Rc;
+      d2f = -2520.0 * x2 * x * xm * xm * xm * (2.0 * x - 1.0) / (Rc * Rc);
+      break;
+    default: {
+      double T = std::tanh(-xm), dT = -(1.0 - T * T) / Rc;
+      f = T * T * T;
+      df = 3.0 * T * T * dT;
+      d2f = -(6.0 * T - 12.0 * T * T * T) * dT / Rc;
+    }
+  }
+  y[0] = R <= Rc ? f : 0.0;
+  y[1] = R <= Rc ? df : 0.0;
+  y[2] = R <= Rc ? d2f : 0.0;
+}
+
+// radial function exp(-eta * (R - Rs)^2) * fc(R) tabulated on n intervals
+// of [0, Rc] by quintic Hermite polynomials, which match its value and
+// 1st and 2nd derivatives at the knots. the derivative is that of
+// the same polynomial, so forces are consistent with the tabulated G.
+// 0 at and beyond Rc
+class RadialTable {
+ public:
+  int n;                                 // # of intervals
+  double scale;                          // n / Rc
+  int fctype;                            // type of fc
+  vector<double> coeff;                  // 6 coefficients of each interval
+
+  RadialTable();
+
+  void build(int, double, double, double, int);
+
+  void error(double, double, double, double &, double &) const;
+
+  inline void eval(double R, double &g, double &dg) const {
+    double x = R * scale;
+    int i = (int)x;
+    if (i >= n) {
+      g = dg = 0.0;
+      return;
+    }
+    double t = x - i;
+    const double *c = &coeff[6 * i];
+    g = c[0] + t * (c[1] + t * (c[2] + t * (c[3] + t * (c[4] + t * c[5]))));
+    dg = (c[1] + t * (2.0 * c[2] + t * (3.0 * c[3] +
+                                       t * (4.0 * c[4] + t * 5.0 * c[5])))) *
+         scale;
+  }
+};
+
+// G1 and G2 parameter sets as flat arrays, G1 is G2 with eta = 0.
+// parameter sets (also of G4) with the same Rc share one cutoff function,
+// all of one type
+class RadialParams {
+ public:
+  int fctype;                            // type of cutoff function
+  vector<double> Rc;                     // distinct cutoff radii
+  vector<int> iRc;                       // index of Rc of each set
+  vector<double> eta, Rs;
+  vector<int> iparam;                    // 1st feature index of each set
+  vector<RadialTable> tables;            // table of each set, or empty
+
+  RadialParams();
+
+  int cutoff_index(double);
+
+  void add(double, double, double, int);
+
+  void tabulate(int);
+};
+
+// angular parts of integer zeta up to this are expanded in moments
+#define NNP_MOMENT_MAX_ZETA 8
+
+// G4 parameter sets grouped by their factors. sets with the same eta and Rc
+// share the radial part exp(-eta * R^2) * fc, and sets with the same lambda
+// and zeta share the angular part 2^(1-zeta) * (1 + lambda * cos)^zeta,
+// so each distinct part is computed once per J neighbor or J-K pair.
+// an angular part of integer zeta is a polynomial of cos = u_j . u_k of unit
+// vectors, sum_n C(zeta, n) lambda^n (u_j . u_k)^n, and each power is a sum
+// of monomials u_j^a u_k^a over exponents a = (ax, ay, az), so the sum over
+// J-K pairs is a sum over monomials of products of moments
+// sum_j rad_j u_j^a of J neighbors of each element, with no J-K pair list
+class AngularParams {
+ public:
+  vector<double> Rc, eta;                // distinct radial parts
+  vector<int> iRc;                       // index of Rc in RadialParams
+  vector<RadialTable> tables;            // table of each radial part, or empty
+  vector<double> lambda, zeta;           // distinct angular parts
+  vector<int> izeta;                     // zeta if a positive integer, else 0
+  vector<int> irad, iang;                // radial and angular part of each set
+  vector<int> iparam;                    // 1st feature index of each set
+
+  vector<int> moment;                    // 1 if angular part is expanded
+  int nmoment;                           // # of sets of expanded parts
+  double Rcdense;                        // max Rc of the other sets, or 0
+  double Rcmoment;                       // max Rc of sets of expanded parts
+  int nelement;                          // # of elements of J neighbors
+  vector<int> combination;               // G4 index of 2 elements, flat
+  int maxdegree;                         // max zeta of expanded parts
+  int nmono;                             // # of monomials up to maxdegree
+  vector<int> mdegree;                   // degree of each monomial,
+                                         // in increasing order
+  vector<int> mprev, maxis;              // monomial = mprev * u_maxis
+  vector<int> mdown[3];                  // monomial / u_x, u_y, u_z, or 0
+  vector<double> mexp[3];                // exponents ax, ay, az
+  vector<double> mmult;                  // multinomial coefficient
+  MatrixXd mcoeff;                       // 2^(1-zeta) C(zeta, n) lambda^n,
+                                         // degree n x angular part
+  vector<double> mdiag;                  // the angular part at J = K,
+                                         // 2^(1-zeta) (1 + lambda)^zeta
+
+  AngularParams();
+
+  void add(double, int, double, double, double, int);
+
+  void tabulate(int, int);
+
+  void expand(int, const vector<vector<int> > &);
+};
+
+// stages and counters of pair_style nnp timing yes
+enum { TIME_GEOMETRY, TIME_RADIAL, TIME_ANGULAR, TIME_PREPROCESS, TIME_NN,
+       TIME_FORCE, NTIME };
+enum { COUNT_ATOM, COUNT_NEIGH, COUNT_TRIPLET, NCOUNT };
+
+// scratch buffers for symmetry functions of I atoms and for the batch of them
+// they are sized for nneigh J neighbors and grow only when needed,
+// so no memory is allocated per atom in the steady state.
+// only the first jnum elements (rows/columns) of each buffer are valid.
+class Workspace {
+ public:
+  int nfeature;                          // # of symmetry functions
+  int nneigh;                            // capacity in # of J neighbors
+  int nbatch;                            // capacity in # of I atoms
+  int ncutoff;                           // # of distinct cutoff radii
+  int derivative;                        // 1 if dG_* are allocated
+  VectorXd R, rinv, dR[3];               // |r_ij|, 1/|r_ij|, r_ij / |r_ij|
+  MatrixXd fc, dfc;                      // cutoff function of J and each Rc
+  vector<int> iG2s;                      // feature index of J
+  vector<int> neigh3;                    // J within cutoff of G4
+  int ntriplet;                          // # of J-K pairs within cutoff of G4
+  int maxtriplet;                        // capacity in # of J-K pairs
+  vector<int> tj, tk;                    // J and K of each pair, tj < tk
+  vector<int> iG3s;                      // feature index of each pair
+  VectorXd cos;                          // cos(theta_jik)
+  VectorXd dcos_j[3], dcos_k[3];         // d cos / dr_ij and d cos / dr_ik
+  MatrixXd rad4[2];                      // radial parts of G4 and their
+                                         // derivatives, J x distinct part
+  MatrixXd trad[3];                      // their products of J and K, and
+                                         // with d/dR_j and d/dR_k, per pair
+  MatrixXd tang[2];                      // angular parts of G4 and d/dcos,
+                                         // pair x distinct part
+  VectorXd tpow;                         // scratch of integer powers
+  MatrixXd mono;                         // monomials of unit vectors,
+                                         // monomial x J
+  MatrixXd mom;                          // moments of J neighbors and sum of
+                                         // rad^2 in the last row, monomial x
+                                         // (radial part, element)
+  MatrixXd madj;                         // dE/d moments of the adjoint mode,
+                                         // else moments times mmult
+  VectorXd mdiagw;                       // dE/d sum of rad^2, the same
+  int pairterms;                         // 1 if radial terms are read from
+                                         // pterm instead of computed
+  vector<const double *> pterm;          // radial terms of each J, shared
+                                         // by I and J (see radial_terms)
+  int pterm_angular;                     // offset of terms of G4 in pterm
+  VectorXd G;                            // symmetry functions of I atom
+  VectorXd F[3];                         // forces on J neighbors
+  vector<VectorXd> r;                    // r_ij, 3 per I atom in batch
+  vector<MatrixXd> dG_dx, dG_dy, dG_dz;  // dG/dr_ij per I atom in batch
+  MatrixXd Gs, dE_dGs;                   // NN input and dE/dG of batch
+  VectorXd evdwls;                       // atomic energies of batch
+  MatrixXf Gsf, dE_dGsf;                 // the same in single precision
+  VectorXf evdwlsf;
+  vector<MatrixXd> nn_out, nn_deriv;     // outputs and derivatives of layers
+  vector<MatrixXf> nn_outf, nn_derivf;
+  vector<vector<int> > ilists;           // I atoms of each element
+  double time[NTIME];                    // seconds spent in each stage
+  double tlap;                           // end of the previous stage
+  double count[NCOUNT];                  // atoms, neighbors, triplets
+  double peak;                           // max bytes of the buffers
+  int nfresh;                            // batch slots evaluated, the rest
+                                         // are reused from the cache
+  double nvisit, nreuse;                 // atoms seen and reused
+  double ncheck, ferr;                   // reused atoms checked, max error
+
+  Workspace();
+
+  ~Workspace();
+
+  void reserve(int, int, int, int, int);
+
+  void reserve_triplet(int);
+
+  double memory_usage();
+};
+
+void distance(int, VectorXd *, Workspace &);
+
+// J-K pairs within Rc, pass Rcdense of AngularParams
+void triplet(double, int, Workspace &);
+
+void cutoff(const RadialParams &, int, Workspace &);
+
+void radial(const RadialParams &, int, Workspace &, VectorXd &, MatrixXd &,
+            MatrixXd &, MatrixXd &);
+
+void angular(const AngularParams &, int, Workspace &, VectorXd &, MatrixXd &,
+             MatrixXd &, MatrixXd &);
+
+// radial terms of one pair: G1/G2 values and d/dR of each set, then
+// radial parts of G4 and d/dR of each distinct one, 2 * (# of sets of
+// RadialParams + # of radial parts of AngularParams) values in total
+// at most NNP_MAX_CUTOFF distinct Rc
+#define NNP_MAX_CUTOFF 16
+
+int radial_terms_size(const RadialParams &, const AngularParams &);
+
+void radial_terms(const RadialParams &, const AngularParams &, double,
+                  double *);
+
+// adjoint mode: G only, then forces on J neighbors from dE/dG into ws.F
+
+void radial_value(const RadialParams &, int, Workspace &, VectorXd &);
+
+void radial_force(const RadialParams &, int, Workspace &, const double *);
+
+void angular_value(const AngularParams &, int, Workspace &, VectorXd &);
+
+void angular_force(const AngularParams &, int, Workspace &, const double *);
 
 #endif  // HDNNP_LAMMPS_SYMMETRY_FUNCTION_H
@@ -0,0 +1,345 @@
+//
+// micro-benchmark of the stages of pair_style nnp on synthetic neighborhoods
+//
+// usage: nnp_bench potential_file element1 element2 ... [keyword value ...]
+//   structure wurtzite|compressed|liquid : neighborhood of I atoms
+//                                          (default wurtzite)
+//   neigh n1,n2,...  : # of J neighbors of I atom, nearest ones are taken
+//                      (default 16,32,48,64,96,128)
+//   batch N          : # of I atoms fed to NN at once (default 128)
+//   repeat N         : # of repetitions of each batch (default 20)
+//   table N          : radial functions from tables of N intervals
+//                      (default 0, analytic)
+//   merge yes|no     : preprocesses merged into NN (default yes), as
+//                      pair_style nnp. with no, they are applied to G and dG
+//                      of each I atom and the adjoint mode is skipped
+//   moment yes|no    : G4 of small integer zeta from moments (default yes),
+//                      as pair_style nnp, or all over J-K pairs
+//
+// elements are the same as in pair_coeff, I atoms are of the 1st element.
+// "wurtzite" is GaN (a = 3.189, c = 5.185, u = 0.377) with the 1st element
+// on Ga sites and the 2nd on N sites, "compressed" is the same with lattice
+// constants scaled by 0.92, and "liquid" is random positions at the same
+// density with the minimum distance of 1.6 and random elements.
+// I atoms in a batch differ by random displacements of 0.05.
+//
+// compile (not a part of LAMMPS, don't link into src/), with MKL as LAMMPS:
+//   g++ -O3 -fopenmp-simd -I.. -I path_to_eigen -mkl -o nnp_bench
+//       nnp_bench.cpp ../nnp_model.cpp ../neural_network_potential.cpp
+//       ../symmetry_function.cpp ../potential_file.cpp
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "nnp_model.h"
+
+static double wtime() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.0e-6 * tv.tv_usec;
+}
+
+static void die(const string &msg) {
+  cerr << "ERROR: " << msg << endl;
+  exit(1);
+}
+
+/* ---------------------------------------------------------------------- */
+
+// the potential file as pair_style nnp reads it
+static void load(const char *file, NNPModel &m, int merge, int ntable,
+                 int moment) {
+  string err;
+
+  if (m.load(file, err)) die(err);
+  if (merge && m.npreprocess > 0) m.merge_preprocess();
+  m.setup(ntable, moment ? NNP_MOMENT_MAX_ZETA : 0);
+}
+
+/* ---------------------------------------------------------------------- */
+
+// neighbors of an atom at the origin sorted by distance, and their elements
+static void neighborhood(const string &structure, int nmax, int nelements,
+                         vector<double> &pos, vector<int> &type) {
+  int i, j, k, b;
+  vector<pair<double, int> > order;
+  vector<double> all;
+  vector<int> alltype;
+
+  if (structure == "wurtzite" || structure == "compressed") {
+    double scale = structure == "compressed" ? 0.92 : 1.0;
+    double a = 3.189 * scale, c = 5.185 * scale, u = 0.377;
+    double basis[4][3] = {{0.0, 0.0, 0.0},
+                          {1.0 / 3, 2.0 / 3, 0.5},
+                          {0.0, 0.0, u},
+                          {1.0 / 3, 2.0 / 3, 0.5 + u}};
+    int n = (int)ceil(pow(nmax, 1.0 / 3)) + 2;
+    for (i = -n; i <= n; i++)
+      for (j = -n; j <= n; j++)
+        for (k = -n; k <= n; k++)
+          for (b = 0; b < 4; b++) {
+            double fa = i + basis[b][0], fb = j + basis[b][1];
+            double fc = k + basis[b][2];
+            all.push_back(a * fa + 0.5 * a * fb);
+            all.push_back(0.5 * sqrt(3.0) * a * fb);
+            all.push_back(c * fc);
+            alltype.push_back((b / 2) % nelements);
+          }
+  } else if (structure == "liquid") {
+    double rho = 4.0 / (3.189 * 3.189 * 0.5 * sqrt(3.0) * 5.185);
+    double R = pow(3.0 * 2 * (nmax + 1) / (4.0 * M_PI * rho), 1.0 / 3);
+    all.push_back(0.0);
+    all.push_back(0.0);
+    all.push_back(0.0);
+    alltype.push_back(0);
+    while ((int)alltype.size() < 2 * (nmax + 1)) {
+      double x[3], r2 = 0.0;
+      for (k = 0; k < 3; k++) x[k] = R * (2.0 * rand() / RAND_MAX - 1.0);
+      for (k = 0; k < 3; k++) r2 += x[k] * x[k];
+      if (r2 > R * R) continue;
+      for (i = 0; i < (int)alltype.size(); i++) {
+        double d2 = 0.0;
+        for (k = 0; k < 3; k++)
+          d2 += (x[k] - all[3 * i + k]) * (x[k] - all[3 * i + k]);
+        if (d2 < 1.6 * 1.6) break;
+      }
+      if (i < (int)alltype.size()) continue;
+      for (k = 0; k < 3; k++) all.push_back(x[k]);
+      alltype.push_back(rand() % nelements);
+    }
+  } else
+    die("Unknown structure " + structure);
+
+  for (i = 0; i < (int)alltype.size(); i++) {
+    double r2 = 0.0;
+    for (k = 0; k < 3; k++) r2 += all[3 * i + k] * all[3 * i + k];
+    if (r2 > 0.0) order.push_back(make_pair(r2, i));
+  }
+  sort(order.begin(), order.end());
+  if ((int)order.size() < nmax) die("Too many neighbors");
+  for (i = 0; i < nmax; i++) {
+    for (k = 0; k < 3; k++) pos.push_back(all[3 * order[i].second + k]);
+    type.push_back(alltype[order[i].second]);
+  }
+}
+
+/* ---------------------------------------------------------------------- */
+
+// stages of the direct and adjoint force paths, in ns per I atom
+enum { GEOMETRY, INDEX, CUTOFF, RADIAL, ANGULAR, PREPROCESS, NN, FORCE,
+       ADJOINT, NSTAGE };
+static const char *stage_names[NSTAGE] = {
+    "geometry", "index", "cutoff", "G1/G2", "G4",
+    "preproc", "NN", "force", "adjoint"};
+
+static void bench(NNPModel &m, int jnum, int nb, int repeat,
+                  const vector<double> &pos, const vector<int> &type) {
+  int ib, jj, k, p, t, rep, ntriplet;
+  double t0, t1, elapsed[NSTAGE];
+  Workspace ws;
+  vector<vector<int> > types(nb);
+  NNP<double> &nnp = m.masters[0];
+  int ninput = nnp.layers[0].weight.cols();
+  int tabulated =
+      !m.angular_params.tables.empty() || !m.radial_params.tables.empty();
+
+  ws.reserve(m.nfeature, m.radial_params.Rc.size(), jnum, nb, 1);
+  ws.Gs.resize(ninput, nb);
+  ws.dE_dGs.resize(ninput, nb);
+  ws.evdwls.resize(nb);
+
+  for (ib = 0; ib < nb; ib++) {
+    for (k = 0; k < 3; k++)
+      for (jj = 0; jj < jnum; jj++)
+        ws.r[3 * ib + k][jj] =
+            pos[3 * jj + k] + 0.05 * (2.0 * rand() / RAND_MAX - 1.0);
+    types[ib].assign(type.begin(), type.begin() + jnum);
+  }
+
+  for (k = 0; k < NSTAGE; k++) elapsed[k] = 0.0;
+  ntriplet = 0;
+
+  for (rep = 0; rep < repeat; rep++) {
+    for (ib = 0; ib < nb; ib++) {
+      VectorXd *r = &ws.r[3 * ib];
+
+      t0 = wtime();
+      distance(jnum, r, ws);
+      triplet(m.angular_params.Rcdense, jnum, ws);
+      t1 = wtime();
+      elapsed[GEOMETRY] += t1 - t0;
+      ntriplet += ws.ntriplet;
+
+      for (jj = 0; jj < jnum; jj++) ws.iG2s[jj] = types[ib][jj];
+      for (t = 0; t < ws.ntriplet; t++)
+        ws.iG3s[t] = m.combinations[ws.iG2s[ws.tj[t]]][ws.iG2s[ws.tk[t]]];
+      t0 = wtime();
+      elapsed[INDEX] += t0 - t1;
+
+      if (!tabulated) cutoff(m.radial_params, jnum, ws);
+      t1 = wtime();
+      elapsed[CUTOFF] += t1 - t0;
+
+      MatrixXd &dG_dx = ws.dG_dx[ib];
+      MatrixXd &dG_dy = ws.dG_dy[ib];
+      MatrixXd &dG_dz = ws.dG_dz[ib];
+
+      // preprocesses changed the shape of buffers at the previous repeat
+      if (m.npreprocess > 0 && dG_dx.rows() != m.nfeature) {
+        dG_dx.resize(m.nfeature, ws.nneigh);
+        dG_dy.resize(m.nfeature, ws.nneigh);
+        dG_dz.resize(m.nfeature, ws.nneigh);
+      }
+
+      ws.G.setZero(m.nfeature);
+      dG_dx.leftCols(jnum).setZero();
+      dG_dy.leftCols(jnum).setZero();
+      dG_dz.leftCols(jnum).setZero();
+      radial(m.radial_params, jnum, ws, ws.G, dG_dx, dG_dy, dG_dz);
+      t0 = wtime();
+      elapsed[RADIAL] += t0 - t1;
+
+      angular(m.angular_params, jnum, ws, ws.G, dG_dx, dG_dy, dG_dz);
+      t1 = wtime();
+      elapsed[ANGULAR] += t1 - t0;
+
+      // unmerged chain on G and dG of the 1st element, as PairNNP
+      for (p = 0; p < m.npreprocess; p++)
+        (m.*m.preprocesses[p])(0, ws.G, dG_dx, dG_dy, dG_dz);
+      t0 = wtime();
+      elapsed[PREPROCESS] += t0 - t1;
+      ws.Gs.col(ib) = ws.G;
+    }
+
+    t0 = wtime();
+    nnp.feedforward(ws.Gs, ws.dE_dGs, 1, ws.evdwls, ws.nn_out, ws.nn_deriv);
+    t1 = wtime();
+    elapsed[NN] += t1 - t0;
+
+    for (ib = 0; ib < nb; ib++) {
+      t0 = wtime();
+      ws.F[0].head(jnum).noalias() =
+          -1.0 * ws.dG_dx[ib].leftCols(jnum).transpose() * ws.dE_dGs.col(ib);
+      ws.F[1].head(jnum).noalias() =
+          -1.0 * ws.dG_dy[ib].leftCols(jnum).transpose() * ws.dE_dGs.col(ib);
+      ws.F[2].head(jnum).noalias() =
+          -1.0 * ws.dG_dz[ib].leftCols(jnum).transpose() * ws.dE_dGs.col(ib);
+      t1 = wtime();
+      elapsed[FORCE] += t1 - t0;
+
+      // the 2nd pass of adjoint mode, including geometry, which needs
+      // dE/dG of raw G as pair_style nnp adjoint yes
+      if (m.npreprocess > 0) continue;
+      const double *dE_dG = &ws.dE_dGs.coeffRef(0, ib);
+      for (k = 0; k < 3; k++) ws.F[k].head(jnum).setZero();
+      distance(jnum, &ws.r[3 * ib], ws);
+      triplet(m.angular_params.Rcdense, jnum, ws);
+      for (jj = 0; jj < jnum; jj++) ws.iG2s[jj] = types[ib][jj];
+      for (t = 0; t < ws.ntriplet; t++)
+        ws.iG3s[t] = m.combinations[ws.iG2s[ws.tj[t]]][ws.iG2s[ws.tk[t]]];
+      if (!tabulated) cutoff(m.radial_params, jnum, ws);
+      radial_force(m.radial_params, jnum, ws, dE_dG);
+      angular_force(m.angular_params, jnum, ws, dE_dG);
+      t0 = wtime();
+      elapsed[ADJOINT] += t0 - t1;
+    }
+  }
+
+  double total = 0.0;
+  cout << setw(5) << jnum << setw(8) << ntriplet / (repeat * nb);
+  for (k = 0; k < NSTAGE; k++) {
+    double ns = 1.0e9 * elapsed[k] / (repeat * nb);
+    if (k != ADJOINT) total += ns;
+    cout << setw(10) << fixed << setprecision(1) << ns;
+  }
+  cout << setw(10) << total << endl;
+}
+
+/* ---------------------------------------------------------------------- */
+
+int main(int argc, char **argv) {
+  int i, iarg, nb = 128, repeat = 20, ntable = 0, merge = 1, moment = 1;
+  string structure = "wurtzite";
+  vector<int> neighs;
+  vector<string> elements;
+  NNPModel m;
+
+  if (argc < 3) {
+    cerr << "usage: " << argv[0] << " potential_file element ... "
+         << "[structure S] [neigh n1,n2,...] [batch N] [repeat N] "
+         << "[table N] [merge yes|no] [moment yes|no]" << endl;
+    return 1;
+  }
+
+  for (iarg = 2; iarg < argc; iarg++) {
+    if (strcmp(argv[iarg], "structure") == 0 ||
+        strcmp(argv[iarg], "neigh") == 0 || strcmp(argv[iarg], "batch") == 0 ||
+        strcmp(argv[iarg], "repeat") == 0 || strcmp(argv[iarg], "table") == 0 ||
+        strcmp(argv[iarg], "merge") == 0 || strcmp(argv[iarg], "moment") == 0)
+      break;
+    elements.push_back(argv[iarg]);
+  }
+  for (; iarg + 1 < argc; iarg += 2) {
+    if (strcmp(argv[iarg], "structure") == 0)
+      structure = argv[iarg + 1];
+    else if (strcmp(argv[iarg], "batch") == 0)
+      nb = atoi(argv[iarg + 1]);
+    else if (strcmp(argv[iarg], "repeat") == 0)
+      repeat = atoi(argv[iarg + 1]);
+    else if (strcmp(argv[iarg], "table") == 0)
+      ntable = atoi(argv[iarg + 1]);
+    else if (strcmp(argv[iarg], "merge") == 0)
+      merge = strcmp(argv[iarg + 1], "no") != 0;
+    else if (strcmp(argv[iarg], "moment") == 0)
+      moment = strcmp(argv[iarg + 1], "no") != 0;
+    else if (strcmp(argv[iarg], "neigh") == 0) {
+      stringstream ss(argv[iarg + 1]);
+      string n;
+      while (getline(ss, n, ',')) neighs.push_back(atoi(n.c_str()));
+    } else
+      die(string("Unknown keyword ") + argv[iarg]);
+  }
+  if (iarg != argc) die("Missing value of keyword");
+  if (neighs.empty()) {
+    int def[] = {16, 32, 48, 64, 96, 128};
+    neighs.assign(def, def + 6);
+  }
+  if (elements.empty() || nb <= 0 || repeat <= 0 || ntable < 0)
+    die("Illegal arguments");
+
+  m.set_elements(elements);
+  load(argv[1], m, merge, ntable, moment);
+  srand(12345);
+
+  vector<double> pos;
+  vector<int> type;
+  neighborhood(structure, *max_element(neighs.begin(), neighs.end()),
+               m.nelements, pos, type);
+
+  cout << "# " << structure << ", " << m.nfeature << " symmetry functions, "
+       << "batch " << nb << ", repeat " << repeat;
+  if (ntable > 0) cout << ", radial tables of " << ntable << " intervals";
+  if (m.angular_params.nmoment > 0)
+    cout << ", " << m.angular_params.nmoment << " G4 from moments";
+  cout << endl;
+  if (m.npreprocess > 0)
+    cout << "# " << m.npreprocess << " preprocesses not merged, adjoint is "
+         << "skipped" << endl;
+  cout << "# ns per I atom, total is the direct path without adjoint" << endl;
+  cout << "# jnum triplet";
+  for (i = 0; i < NSTAGE; i++) cout << setw(10) << stage_names[i];
+  cout << setw(10) << "total" << endl;
+
+  for (i = 0; i < (int)neighs.size(); i++)
+    bench(m, neighs[i], nb, repeat, pos, type);
+
+  return 0;
+}
@@ -0,0 +1,462 @@
+//
+// checks of pair_style nnp on a periodic configuration, outside LAMMPS
+//
+// usage: nnp_check potential_file element1 element2 ... [keyword value ...]
+//   cells nx,ny,nz : orthorhombic cells of wurtzite GaN (default 3,2,2)
+//   displace d     : random displacements of atoms (default 0.1)
+//   steps n        : steps of the NVE runs (default 200)
+//   dt t           : timestep in ps (default 0.0005)
+//   temp T         : initial temperature in K (default 300)
+//   masses m1,...  : masses of the elements in g/mol (default 69.723,14.007)
+//
+// forces of the merged model on a displaced I atom and its neighbors are
+// compared with -dE/dx by central differences of the total energy, which
+// checks the accumulation of forces itself, the same as in PairNNP::eval.
+// the energy and forces of the preprocess chain applied to G and dG
+// (pair_style nnp merge no) are compared with those of the preprocesses
+// merged into the 1st layer (merge yes), which must agree to round-off,
+// and those of NN in single precision (precision mixed) with double
+// precision, within NNP_MIXED_TOLERANCE.
+// forces of the adjoint mode (adjoint yes) and G4 of integer zeta from
+// moments are compared with the direct path and with the sums over J-K
+// pairs in the same way as merge.
+// the static check can't see errors that build up along a trajectory, as
+// forces of NN in single precision are not the exact gradients of its
+// energy. so the configuration is also run by velocity Verlet in NVE (metal
+// units) in double and single precision, and the drift of the total energy
+// of the mixed run must be within NNP_DRIFT_RATIO times that of the double
+// run, which is the error of the integrator alone.
+// the structure is the same as that of nnp_bench, the 1st element on Ga
+// sites and the 2nd on N sites, and atoms are displaced randomly.
+// "FAILED" is printed and the exit status is 1 if a check fails.
+//
+// compile (not a part of LAMMPS, don't link into src/), with MKL as LAMMPS:
+//   g++ -O2 -fopenmp-simd -I.. -I path_to_eigen -mkl -o nnp_check
+//       nnp_check.cpp ../nnp_model.cpp ../neural_network_potential.cpp
+//       ../symmetry_function.cpp ../potential_file.cpp
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "nnp_model.h"
+
+// displacement (A) of central differences and their max error relative to
+// the largest force
+#define NNP_FD_STEP 1.0e-4
+#define NNP_FD_TOLERANCE 1.0e-6
+
+// max drift of the total energy in single precision relative to double
+// precision, and the drift under which both are taken to be 0, eV/atom/ps
+#define NNP_DRIFT_RATIO 10.0
+#define NNP_DRIFT_FLOOR 1.0e-6
+
+// metal units, mv^2 in g/mol (A/ps)^2 to eV and Boltzmann constant in eV/K
+#define MVV2E 1.0364269e-4
+#define BOLTZ 8.617343e-5
+
+// atoms in an orthorhombic periodic box
+struct Config {
+  int natoms;
+  double box[3];
+  vector<double> x;            // positions, 3 per atom
+  vector<int> type;            // element of each atom
+};
+
+static void die(const string &msg) {
+  cerr << "ERROR: " << msg << endl;
+  exit(1);
+}
+
+/* ---------------------------------------------------------------------- */
+
+// wurtzite GaN (a = 3.189, c = 5.185, u = 0.377) of nx x ny x nz cells of
+// 8 atoms, a x sqrt(3) a x c, with random displacements
+static void wurtzite(const int *cells, double displace, int nelements,
+                     Config &c) {
+  int i, j, k, b, s, d;
+  double a = 3.189, h = 5.185, u = 0.377;
+  double basis[4][3] = {{0.0, 0.0, 0.0},
+                        {1.0 / 3, 2.0 / 3, 0.5},
+                        {0.0, 0.0, u},
+                        {1.0 / 3, 2.0 / 3, 0.5 + u}};
+  double cell[3] = {a, sqrt(3.0) * a, h};
+
+  for (d = 0; d < 3; d++) c.box[d] = cells[d] * cell[d];
+  c.x.clear();
+  c.type.clear();
+  for (i = 0; i < cells[0]; i++)
+    for (j = 0; j < cells[1]; j++)
+      for (k = 0; k < cells[2]; k++)
+        for (b = 0; b < 4; b++)
+          for (s = 0; s < 2; s++) {
+            double p[3];
+            p[0] = (basis[b][0] + 0.5 * basis[b][1] + 0.5 * s + i) * cell[0];
+            p[1] = (0.5 * basis[b][1] + 0.5 * s + j) * cell[1];
+            p[2] = (basis[b][2] + k) * cell[2];
+            for (d = 0; d < 3; d++) {
+              p[d] += displace * (2.0 * rand() / RAND_MAX - 1.0);
+              c.x.push_back(p[d] - c.box[d] * floor(p[d] / c.box[d]));
+            }
+            c.type.push_back((b / 2) % nelements);
+          }
+  c.natoms = c.type.size();
+}
+
+/* ---------------------------------------------------------------------- */
+
+// total energy and forces -dE/dx from G and dG/dr_ij of one I atom at a
+// time as pair_style nnp computes them, J neighbors are all periodic images
+// within cutmax. each J gets -dE_i/dr_ij and I atom its reaction, as in
+// PairNNP::eval and PairNNPOMP::eval.
+// with single, NN runs in single precision as PairNNP::batch does
+// with adjoint, forces are from dE/dG contracted on the fly as pair_style
+// nnp adjoint yes, which needs merged preprocesses
+static void evaluate(NNPModel &m, vector<NNP<float> > *single, int adjoint,
+                     const Config &c, double &energy, vector<double> &f) {
+  int i, j, jj, k, p, t, jnum, n[3], s[3];
+  double del[3], rsq;
+  double cutsq = m.cutmax * m.cutmax;
+  Workspace ws;
+  vector<double> pos[3];
+  vector<int> jlist;
+  VectorXd E(1);
+  VectorXf Ef(1);
+  MatrixXd dE_dG;
+  MatrixXf Gf, dE_dGf;
+  vector<MatrixXd> out, deriv;
+  vector<MatrixXf> outf, derivf;
+
+  for (k = 0; k < 3; k++) n[k] = (int)ceil(m.cutmax / c.box[k]);
+  energy = 0.0;
+  f.assign(3 * c.natoms, 0.0);
+
+  for (i = 0; i < c.natoms; i++) {
+    for (k = 0; k < 3; k++) pos[k].clear();
+    jlist.clear();
+    for (j = 0; j < c.natoms; j++)
+      for (s[0] = -n[0]; s[0] <= n[0]; s[0]++)
+        for (s[1] = -n[1]; s[1] <= n[1]; s[1]++)
+          for (s[2] = -n[2]; s[2] <= n[2]; s[2]++) {
+            rsq = 0.0;
+            for (k = 0; k < 3; k++) {
+              del[k] = c.x[3 * j + k] + s[k] * c.box[k] - c.x[3 * i + k];
+              rsq += del[k] * del[k];
+            }
+            if (rsq == 0.0 || rsq >= cutsq) continue;
+            for (k = 0; k < 3; k++) pos[k].push_back(del[k]);
+            jlist.push_back(j);
+          }
+    jnum = jlist.size();
+
+    ws.reserve(m.nfeature, m.radial_params.Rc.size(), jnum, 1, 1);
+    MatrixXd &dG_dx = ws.dG_dx[0];
+    MatrixXd &dG_dy = ws.dG_dy[0];
+    MatrixXd &dG_dz = ws.dG_dz[0];
+    if (dG_dx.rows() != m.nfeature) {
+      dG_dx.resize(m.nfeature, ws.nneigh);
+      dG_dy.resize(m.nfeature, ws.nneigh);
+      dG_dz.resize(m.nfeature, ws.nneigh);
+    }
+    for (k = 0; k < 3; k++)
+      for (jj = 0; jj < jnum; jj++) ws.r[k][jj] = pos[k][jj];
+
+    distance(jnum, &ws.r[0], ws);
+    triplet(m.angular_params.Rcdense, jnum, ws);
+    for (jj = 0; jj < jnum; jj++) ws.iG2s[jj] = c.type[jlist[jj]];
+    for (t = 0; t < ws.ntriplet; t++)
+      ws.iG3s[t] = m.combinations[ws.iG2s[ws.tj[t]]][ws.iG2s[ws.tk[t]]];
+    cutoff(m.radial_params, jnum, ws);
+
+    ws.G.setZero(m.nfeature);
+    if (adjoint) {
+      radial_value(m.radial_params, jnum, ws, ws.G);
+      angular_value(m.angular_params, jnum, ws, ws.G);
+    } else {
+      dG_dx.leftCols(jnum).setZero();
+      dG_dy.leftCols(jnum).setZero();
+      dG_dz.leftCols(jnum).setZero();
+      radial(m.radial_params, jnum, ws, ws.G, dG_dx, dG_dy, dG_dz);
+      angular(m.angular_params, jnum, ws, ws.G, dG_dx, dG_dy, dG_dz);
+      for (p = 0; p < m.npreprocess; p++)
+        (m.*m.preprocesses[p])(c.type[i], ws.G, dG_dx, dG_dy, dG_dz);
+    }
+
+    dE_dG.resize(ws.G.size(), 1);
+    if (single) {
+      Gf = ws.G.cast<float>();
+      dE_dGf.resize(ws.G.size(), 1);
+      (*single)[c.type[i]].feedforward(Gf, dE_dGf, 1, Ef, outf, derivf);
+      dE_dG = dE_dGf.cast<double>();
+      E = Ef.cast<double>();
+    } else
+      m.masters[c.type[i]].feedforward(ws.G, dE_dG, 1, E, out, deriv);
+    energy += E[0];
+
+    if (adjoint) {
+      for (k = 0; k < 3; k++) ws.F[k].head(jnum).setZero();
+      radial_force(m.radial_params, jnum, ws, dE_dG.data());
+      angular_force(m.angular_params, jnum, ws, dE_dG.data());
+    } else {
+      ws.F[0].head(jnum).noalias() =
+          -1.0 * dG_dx.leftCols(jnum).transpose() * dE_dG.col(0);
+      ws.F[1].head(jnum).noalias() =
+          -1.0 * dG_dy.leftCols(jnum).transpose() * dE_dG.col(0);
+      ws.F[2].head(jnum).noalias() =
+          -1.0 * dG_dz.leftCols(jnum).transpose() * dE_dG.col(0);
+    }
+    for (jj = 0; jj < jnum; jj++)
+      for (k = 0; k < 3; k++) {
+        f[3 * jlist[jj] + k] += ws.F[k][jj];
+        f[3 * i + k] -= ws.F[k][jj];
+      }
+  }
+}
+
+/* ---------------------------------------------------------------------- */
+
+// max differences of energy per atom and force components, relative to
+// the largest of each in the reference, and whether they pass
+static int compare(const string &name, const Config &c, double energy_ref,
+                   const vector<double> &f_ref, double energy,
+                   const vector<double> &f, double tolerance) {
+  int k;
+  double de, df = 0.0, fmax = 0.0;
+
+  de = fabs(energy - energy_ref) / c.natoms;
+  for (k = 0; k < 3 * c.natoms; k++) {
+    df = max(df, fabs(f[k] - f_ref[k]));
+    fmax = max(fmax, fabs(f_ref[k]));
+  }
+  de /= max(1.0, fabs(energy_ref) / c.natoms);
+  df /= max(1.0, fmax);
+
+  int pass = de <= tolerance && df <= tolerance;
+  cout << setw(10) << name << setw(14) << scientific << setprecision(3) << de
+       << setw(14) << df << setw(14) << tolerance << "  "
+       << (pass ? "passed" : "FAILED") << endl;
+  return pass;
+}
+
+// forces f of atom 0 and atoms within cutmax of it (any image) replaced by
+// -dE/dx of central differences of the total energy, others are kept,
+// so that compare() sees only the differences of these atoms
+static void finite_difference(NNPModel &m, const Config &c,
+                              vector<double> &f) {
+  int i, j, k;
+  double rsq, d, ep, em;
+  vector<double> fdummy;
+  Config cd = c;
+
+  for (j = 0; j < c.natoms; j++) {
+    rsq = 0.0;
+    for (k = 0; k < 3; k++) {
+      d = c.x[3 * j + k] - c.x[k];
+      d -= c.box[k] * floor(d / c.box[k] + 0.5);
+      rsq += d * d;
+    }
+    if (rsq >= m.cutmax * m.cutmax) continue;
+    for (k = 0; k < 3; k++) {
+      i = 3 * j + k;
+      cd.x[i] = c.x[i] + NNP_FD_STEP;
+      evaluate(m, NULL, 0, cd, ep, fdummy);
+      cd.x[i] = c.x[i] - NNP_FD_STEP;
+      evaluate(m, NULL, 0, cd, em, fdummy);
+      cd.x[i] = c.x[i];
+      f[i] = -(ep - em) / (2.0 * NNP_FD_STEP);
+    }
+  }
+}
+
+/* ---------------------------------------------------------------------- */
+
+// Maxwell-Boltzmann velocities at temp, without the motion of the center
+static void velocities(const Config &c, const vector<double> &mass,
+                       double temp, vector<double> &v) {
+  int i, k;
+  double u1, u2, sigma, p[3] = {0.0, 0.0, 0.0}, mtotal = 0.0;
+
+  v.resize(3 * c.natoms);
+  for (i = 0; i < c.natoms; i++) {
+    sigma = sqrt(BOLTZ * temp / (mass[c.type[i]] * MVV2E));
+    for (k = 0; k < 3; k++) {
+      u1 = (rand() + 1.0) / (RAND_MAX + 2.0);
+      u2 = rand() / (RAND_MAX + 1.0);
+      v[3 * i + k] = sigma * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+      p[k] += mass[c.type[i]] * v[3 * i + k];
+    }
+    mtotal += mass[c.type[i]];
+  }
+  for (i = 0; i < c.natoms; i++)
+    for (k = 0; k < 3; k++) v[3 * i + k] -= p[k] / mtotal;
+}
+
+// velocity Verlet in NVE from c and v, returns the drift of the total
+// energy per atom, the slope of its least squares fit over time
+static double nve(NNPModel &m, vector<NNP<float> > *single, Config c,
+                  vector<double> v, const vector<double> &mass, int nsteps,
+                  double dt) {
+  int i, k, step;
+  double pe, ke, t, st = 0.0, se = 0.0, stt = 0.0, ste = 0.0;
+  vector<double> f;
+
+  evaluate(m, single, 0, c, pe, f);
+  for (step = 0; step <= nsteps; step++) {
+    if (step > 0) {
+      for (i = 0; i < c.natoms; i++)
+        for (k = 0; k < 3; k++) {
+          double &x = c.x[3 * i + k];
+          v[3 * i + k] += 0.5 * dt * f[3 * i + k] / (mass[c.type[i]] * MVV2E);
+          x += dt * v[3 * i + k];
+          x -= c.box[k] * floor(x / c.box[k]);
+        }
+      evaluate(m, single, 0, c, pe, f);
+      for (i = 0; i < c.natoms; i++)
+        for (k = 0; k < 3; k++)
+          v[3 * i + k] += 0.5 * dt * f[3 * i + k] / (mass[c.type[i]] * MVV2E);
+    }
+    ke = 0.0;
+    for (i = 0; i < c.natoms; i++)
+      for (k = 0; k < 3; k++)
+        ke += 0.5 * MVV2E * mass[c.type[i]] * v[3 * i + k] * v[3 * i + k];
+
+    t = step * dt;
+    st += t;
+    stt += t * t;
+    se += (pe + ke) / c.natoms;
+    ste += t * (pe + ke) / c.natoms;
+  }
+  return (ste - st * se / (nsteps + 1)) / (stt - st * st / (nsteps + 1));
+}
+
+/* ---------------------------------------------------------------------- */
+
+int main(int argc, char **argv) {
+  int iarg, k, ok = 1, nsteps = 200, cells[3] = {3, 2, 2};
+  double displace = 0.1, dt = 0.0005, temp = 300.0, energy_ref, energy;
+  double drift_ref, drift;
+  string err;
+  vector<string> elements;
+  vector<double> f_ref, f, v, mass;
+  vector<NNP<float> > single;
+  NNPModel m;
+  Config c;
+
+  if (argc < 3) {
+    cerr << "usage: " << argv[0] << " potential_file element ... "
+         << "[cells nx,ny,nz] [displace d] [steps n] [dt t] [temp T] "
+         << "[masses m1,...]" << endl;
+    return 1;
+  }
+
+  for (iarg = 2; iarg < argc; iarg++) {
+    if (strcmp(argv[iarg], "cells") == 0 ||
+        strcmp(argv[iarg], "displace") == 0 ||
+        strcmp(argv[iarg], "steps") == 0 || strcmp(argv[iarg], "dt") == 0 ||
+        strcmp(argv[iarg], "temp") == 0 || strcmp(argv[iarg], "masses") == 0)
+      break;
+    elements.push_back(argv[iarg]);
+  }
+  for (; iarg + 1 < argc; iarg += 2) {
+    if (strcmp(argv[iarg], "displace") == 0)
+      displace = atof(argv[iarg + 1]);
+    else if (strcmp(argv[iarg], "steps") == 0)
+      nsteps = atoi(argv[iarg + 1]);
+    else if (strcmp(argv[iarg], "dt") == 0)
+      dt = atof(argv[iarg + 1]);
+    else if (strcmp(argv[iarg], "temp") == 0)
+      temp = atof(argv[iarg + 1]);
+    else if (strcmp(argv[iarg], "masses") == 0) {
+      stringstream ss(argv[iarg + 1]);
+      string m;
+      mass.clear();
+      while (getline(ss, m, ',')) mass.push_back(atof(m.c_str()));
+    } else if (strcmp(argv[iarg], "cells") == 0) {
+      stringstream ss(argv[iarg + 1]);
+      string n;
+      for (k = 0; k < 3 && getline(ss, n, ','); k++)
+        cells[k] = atoi(n.c_str());
+      if (k < 3) die("Illegal cells");
+    } else
+      die(string("Unknown keyword ") + argv[iarg]);
+  }
+  if (iarg != argc) die("Missing value of keyword");
+  if (elements.empty() || cells[0] <= 0 || cells[1] <= 0 || cells[2] <= 0 ||
+      nsteps <= 0 || dt <= 0.0 || temp < 0.0)
+    die("Illegal arguments");
+  if (mass.empty()) {
+    mass.push_back(69.723);
+    mass.push_back(14.007);
+  }
+  if (mass.size() < elements.size()) die("Missing masses of elements");
+  for (k = 0; k < (int)elements.size(); k++)
+    if (mass[k] <= 0.0) die("Illegal masses");
+
+  m.set_elements(elements);
+  if (m.load(argv[1], err)) die(err);
+  m.setup(0, NNP_MOMENT_MAX_ZETA);
+  srand(12345);
+  wurtzite(cells, displace, m.nelements, c);
+
+  cout << "# " << c.natoms << " atoms, " << m.nfeature
+       << " symmetry functions, " << m.npreprocess << " preprocesses" << endl;
+  cout << "#    check    energy/atom         force     tolerance" << endl;
+
+  // the merged model in double precision is the reference of both checks,
+  // as pair_style nnp converts the merged NN to single precision
+
+  NNPModel merged = m;
+  if (merged.npreprocess > 0) merged.merge_preprocess();
+  evaluate(merged, NULL, 0, c, energy_ref, f_ref);
+
+  f = f_ref;
+  finite_difference(merged, c, f);
+  ok &= compare("gradient", c, energy_ref, f_ref, energy_ref, f,
+                NNP_FD_TOLERANCE);
+
+  if (m.npreprocess > 0) {
+    evaluate(m, NULL, 0, c, energy, f);
+    ok &= compare("merge", c, energy_ref, f_ref, energy, f, 1.0e-10);
+  }
+
+  evaluate(merged, NULL, 1, c, energy, f);
+  ok &= compare("adjoint", c, energy_ref, f_ref, energy, f, 1.0e-10);
+
+  // G4 of integer zeta from moments, against the sums over J-K pairs
+  if (merged.angular_params.nmoment > 0) {
+    NNPModel dense = merged;
+    dense.angular_params.expand(0, dense.combinations);
+    evaluate(dense, NULL, 0, c, energy, f);
+    ok &= compare("moment", c, energy_ref, f_ref, energy, f, 1.0e-10);
+  }
+
+  for (k = 0; k < m.nelements; k++)
+    single.push_back(NNP<float>(merged.masters[k]));
+  evaluate(merged, &single, 0, c, energy, f);
+  ok &= compare("mixed", c, energy_ref, f_ref, energy, f, NNP_MIXED_TOLERANCE);
+
+  // the same NVE run from the same velocities in both precisions
+
+  velocities(c, mass, temp, v);
+  drift_ref = nve(merged, NULL, c, v, mass, nsteps, dt);
+  drift = nve(merged, &single, c, v, mass, nsteps, dt);
+  int pass = fabs(drift) <= NNP_DRIFT_RATIO * max(fabs(drift_ref),
+                                                  NNP_DRIFT_FLOOR);
+  ok &= pass;
+
+  cout << "# NVE " << nsteps << " steps of " << defaultfloat << dt
+       << " ps from " << temp << " K" << endl;
+  cout << "#    check  drift (eV/atom/ps)         limit" << endl;
+  cout << setw(10) << "double" << setw(22) << scientific << setprecision(3)
+       << drift_ref << endl;
+  cout << setw(10) << "mixed" << setw(22) << drift << setw(14)
+       << NNP_DRIFT_RATIO * max(fabs(drift_ref), NNP_DRIFT_FLOOR) << "  "
+       << (pass ? "passed" : "FAILED") << endl;
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,43 @@
+//
+// convert a text potential file into the binary format
+//
+// usage: nnp_convert text_file binary_file element1 element2 ...
+// elements are the same as in pair_coeff, only their number is used
+//
+// compile (not a part of LAMMPS, don't link into src/):
+//   g++ -O2 -I.. -o nnp_convert nnp_convert.cpp ../potential_file.cpp
+//
+
+#include <fstream>
+#include <iostream>
+
+#include "potential_file.h"
+
+int main(int argc, char **argv) {
+  string err;
+  vector<char> image;
+
+  if (argc < 4) {
+    cerr << "usage: " << argv[0] << " text_file binary_file element ..."
+         << endl;
+    return 1;
+  }
+
+  ifstream fin(argv[1]);
+  if (!fin) {
+    cerr << "ERROR: Cannot open " << argv[1] << endl;
+    return 1;
+  }
+  if (text_to_image(fin, argc - 3, image, err)) {
+    cerr << "ERROR: " << err << endl;
+    return 1;
+  }
+
+  ofstream fout(argv[2], ios::binary);
+  fout.write(&image[0], image.size());
+  if (!fout) {
+    cerr << "ERROR: Cannot write " << argv[2] << endl;
+    return 1;
+  }
+  return 0;
+}